@@ -0,0 +1,205 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+
+/*
+Bit-packed map, 64 bits per word. The file system keeps its free block
+map in one of these, with a set bit meaning "free". Searches skip whole
+words at a time and pick the bit with count-trailing-zeros.
+*/
+
+static int word_of( int bit )
+{
+	return bit / BITS_PER_WORD;
+}
+
+static uint64_t mask_of( int bit )
+{
+	return (uint64_t)1 << (bit % BITS_PER_WORD);
+}
+
+int bitmap_init( struct bitmap *bm, int nbits, int value )
+{
+	bm->nbits = nbits;
+	bm->nwords = (nbits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+	bm->hint = 0;
+	bm->words = malloc(bm->nwords*sizeof(uint64_t));
+	if(!bm->words) return 0;
+
+	memset(bm->words, value ? 0xff : 0, bm->nwords*sizeof(uint64_t));
+
+	// Bits past the end are kept clear so searches never return them
+	if(value && nbits % BITS_PER_WORD) {
+		bm->words[bm->nwords-1] = mask_of(nbits) - 1;
+	}
+	bm->nset = value ? nbits : 0;
+	return 1;
+}
+
+void bitmap_destroy( struct bitmap *bm )
+{
+	free(bm->words);
+	bm->words = 0;
+	bm->nbits = bm->nwords = bm->nset = bm->hint = 0;
+}
+
+int bitmap_test( const struct bitmap *bm, int bit )
+{
+	return (bm->words[word_of(bit)] & mask_of(bit)) != 0;
+}
+
+void bitmap_set( struct bitmap *bm, int bit )
+{
+	uint64_t *w = &bm->words[word_of(bit)];
+	if(!(*w & mask_of(bit))) {
+		*w |= mask_of(bit);
+		bm->nset++;
+	}
+}
+
+void bitmap_clear( struct bitmap *bm, int bit )
+{
+	uint64_t *w = &bm->words[word_of(bit)];
+	if(*w & mask_of(bit)) {
+		*w &= ~mask_of(bit);
+		bm->nset--;
+	}
+}
+
+// Next fit: resume from the word of the last hit and wrap around once
+int bitmap_find_set( struct bitmap *bm )
+{
+	if(bm->nset==0) return -1;
+
+	for(int n=0; n<bm->nwords; n++) {
+		int w = bm->hint + n;
+		if(w>=bm->nwords) w -= bm->nwords;
+		if(bm->words[w]) {
+			bm->hint = w;
+			return w*BITS_PER_WORD + __builtin_ctzll(bm->words[w]);
+		}
+	}
+	return -1;
+}
+
+// First set bit at or after bit, or nbits if there is none
+static int next_set( const struct bitmap *bm, int bit )
+{
+	if(bit>=bm->nbits) return bm->nbits;
+	int w = word_of(bit);
+	uint64_t word = bm->words[w] & ~(mask_of(bit)-1);
+	while(!word) {
+		if(++w>=bm->nwords) return bm->nbits;
+		word = bm->words[w];
+	}
+	return w*BITS_PER_WORD + __builtin_ctzll(word);
+}
+
+// First clear bit at or after bit, or nbits if there is none
+static int next_clear( const struct bitmap *bm, int bit )
+{
+	if(bit>=bm->nbits) return bm->nbits;
+	int w = word_of(bit);
+	uint64_t word = ~bm->words[w] & ~(mask_of(bit)-1);
+	while(!word) {
+		if(++w>=bm->nwords) return bm->nbits;
+		word = ~bm->words[w];
+	}
+	int found = w*BITS_PER_WORD + __builtin_ctzll(word);
+	return found < bm->nbits ? found : bm->nbits;
+}
+
+void bitmap_set_run( struct bitmap *bm, int start, int len )
+{
+	for(int i=start; i<start+len; i++) bitmap_set(bm,i);
+}
+
+void bitmap_clear_run( struct bitmap *bm, int start, int len )
+{
+	for(int i=start; i<start+len; i++) bitmap_clear(bm,i);
+}
+
+/*
+Reserve up to want consecutive set bits by clearing them. The first run
+after the hint that is long enough wins; if the map is too fragmented
+for that, the longest run is taken instead and the caller asks again
+for the rest. Returns the first bit, or -1 if nothing is set, with the
+run length in *got.
+*/
+int bitmap_alloc_run( struct bitmap *bm, int want, int *got )
+{
+	int best = -1, bestlen = 0;
+	int from = bm->hint*BITS_PER_WORD;
+
+	*got = 0;
+	if(bm->nset==0 || want<=0) return -1;
+
+	// Two passes: hint to the end, then the start up to the hint
+	for(int pass=0; pass<2; pass++) {
+		int bit = pass ? 0 : from;
+		int end = pass ? from : bm->nbits;
+		while(bit<end) {
+			int start = next_set(bm,bit);
+			if(start>=end) break;
+			int stop = next_clear(bm,start);
+			if(stop>end) stop = end;
+			if(stop-start>=want) {
+				best = start;
+				bestlen = want;
+				goto found;
+			}
+			if(stop-start>bestlen) {
+				best = start;
+				bestlen = stop-start;
+			}
+			bit = stop;
+		}
+	}
+	if(best<0) return -1;
+
+found:
+	bitmap_clear_run(bm,best,bestlen);
+	bm->hint = word_of(best+bestlen) < bm->nwords ? word_of(best+bestlen) : 0;
+	*got = bestlen;
+	return best;
+}
+
+/*
+Copy the words to or from a buffer of nwords*8 bytes, for keeping the
+map on disk. Loading recomputes nset and drops any bits past the end.
+*/
+void bitmap_load( struct bitmap *bm, const char *data )
+{
+	memcpy(bm->words, data, bm->nwords*sizeof(uint64_t));
+	if(bm->nbits % BITS_PER_WORD) {
+		bm->words[bm->nwords-1] &= mask_of(bm->nbits) - 1;
+	}
+	bm->nset = bitmap_count(bm);
+	bm->hint = 0;
+}
+
+void bitmap_store( const struct bitmap *bm, char *data )
+{
+	memcpy(data, bm->words, bm->nwords*sizeof(uint64_t));
+}
+
+// Keep only the bits also set in src, a map of the same size built separately
+void bitmap_and( struct bitmap *bm, const struct bitmap *src )
+{
+	for(int w=0; w<bm->nwords; w++) {
+		bm->words[w] &= src->words[w];
+	}
+	bm->nset = bitmap_count(bm);
+}
+
+// Recount from scratch, for checking nset
+int bitmap_count( const struct bitmap *bm )
+{
+	int n = 0;
+	for(int w=0; w<bm->nwords; w++) {
+		n += __builtin_popcountll(bm->words[w]);
+	}
+	return n;
+}
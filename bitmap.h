@@ -0,0 +1,33 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+
+#define BITS_PER_WORD 64
+
+struct bitmap {
+	uint64_t *words;
+	int nbits;
+	int nwords;
+	int nset;	// number of set bits, kept up to date by set/clear
+	int hint;	// word where the next search for a set bit starts
+};
+
+int  bitmap_init( struct bitmap *bm, int nbits, int value );
+void bitmap_destroy( struct bitmap *bm );
+
+int  bitmap_test( const struct bitmap *bm, int bit );
+void bitmap_set( struct bitmap *bm, int bit );
+void bitmap_clear( struct bitmap *bm, int bit );
+void bitmap_set_run( struct bitmap *bm, int start, int len );
+void bitmap_clear_run( struct bitmap *bm, int start, int len );
+
+int  bitmap_find_set( struct bitmap *bm );
+int  bitmap_alloc_run( struct bitmap *bm, int want, int *got );
+int  bitmap_count( const struct bitmap *bm );
+
+void bitmap_and( struct bitmap *bm, const struct bitmap *src );
+void bitmap_load( struct bitmap *bm, const char *data );
+void bitmap_store( const struct bitmap *bm, char *data );
+
+#endif
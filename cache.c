@@ -0,0 +1,382 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "disk.h"
+
+/*
+Write-back LRU cache of disk blocks, sitting between fs.c and disk.c.
+Entries live in one array; a chained hash table finds them by block
+number and a doubly linked list keeps them in least-recently-used order.
+Dirty entries are written to disk when evicted or flushed. One mutex
+covers the whole cache, so the file system may call in from several
+threads; cache_init and cache_close must not race with anything.
+*/
+
+struct cache_entry {
+	int blocknum;
+	int dirty;
+	int prev;	// towards most recently used
+	int next;	// towards least recently used
+	int hnext;	// next entry in the same hash bucket
+	char data[DISK_BLOCK_SIZE];
+};
+
+static struct cache_entry *entries = 0;
+static int *buckets = 0;
+static int nbuckets = 0;
+static int capacity = 0;
+static int nused = 0;
+static int lru_head = -1;	// most recently used
+static int lru_tail = -1;	// least recently used
+static int nhits = 0;
+static int nmisses = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+int cache_init( int n )
+{
+	cache_close();
+
+	nhits = 0;
+	nmisses = 0;
+	if(n<=0) return 1;
+
+	entries = malloc(n*sizeof(struct cache_entry));
+	nbuckets = 1;
+	while(nbuckets<2*n) nbuckets *= 2;
+	buckets = malloc(nbuckets*sizeof(int));
+	if(!entries || !buckets) {
+		free(entries);
+		free(buckets);
+		entries = 0;
+		buckets = 0;
+		return 0;
+	}
+
+	for(int i=0; i<nbuckets; i++) {
+		buckets[i] = -1;
+	}
+	capacity = n;
+	nused = 0;
+	lru_head = lru_tail = -1;
+	return 1;
+}
+
+static int hash_block( int blocknum )
+{
+	return (blocknum*2654435761u) & (nbuckets-1);
+}
+
+static int lookup( int blocknum )
+{
+	for(int e=buckets[hash_block(blocknum)]; e>=0; e=entries[e].hnext) {
+		if(entries[e].blocknum==blocknum) return e;
+	}
+	return -1;
+}
+
+static void lru_unlink( int e )
+{
+	if(entries[e].prev>=0) entries[entries[e].prev].next = entries[e].next;
+	else lru_head = entries[e].next;
+	if(entries[e].next>=0) entries[entries[e].next].prev = entries[e].prev;
+	else lru_tail = entries[e].prev;
+}
+
+static void lru_push_front( int e )
+{
+	entries[e].prev = -1;
+	entries[e].next = lru_head;
+	if(lru_head>=0) entries[lru_head].prev = e;
+	lru_head = e;
+	if(lru_tail<0) lru_tail = e;
+}
+
+static void lru_push_back( int e )
+{
+	entries[e].next = -1;
+	entries[e].prev = lru_tail;
+	if(lru_tail>=0) entries[lru_tail].next = e;
+	lru_tail = e;
+	if(lru_head<0) lru_head = e;
+}
+
+static void hash_remove( int e )
+{
+	int *p = &buckets[hash_block(entries[e].blocknum)];
+	while(*p!=e) p = &entries[*p].hnext;
+	*p = entries[e].hnext;
+}
+
+// Returns an entry for blocknum that is not yet filled, evicting if needed
+static int insert( int blocknum )
+{
+	int e;
+
+	if(nused<capacity) {
+		e = nused++;
+	} else {
+		e = lru_tail;
+		if(entries[e].dirty) {
+			disk_write(entries[e].blocknum,entries[e].data);
+		}
+		lru_unlink(e);
+		if(entries[e].blocknum>=0) hash_remove(e);
+	}
+
+	int h = hash_block(blocknum);
+	entries[e].blocknum = blocknum;
+	entries[e].dirty = 0;
+	entries[e].hnext = buckets[h];
+	buckets[h] = e;
+	lru_push_front(e);
+	return e;
+}
+
+static void locked_read( int blocknum, char *data )
+{
+	if(!capacity) {
+		disk_read(blocknum,data);
+		return;
+	}
+
+	int e = lookup(blocknum);
+	if(e>=0) {
+		nhits++;
+		lru_unlink(e);
+		lru_push_front(e);
+	} else {
+		nmisses++;
+		e = insert(blocknum);
+		disk_read(blocknum,entries[e].data);
+	}
+	memcpy(data,entries[e].data,DISK_BLOCK_SIZE);
+}
+
+static void locked_write( int blocknum, const char *data )
+{
+	if(!capacity) {
+		disk_write(blocknum,data);
+		return;
+	}
+
+	// Whole blocks are written, so a miss never needs to read the old contents
+	int e = lookup(blocknum);
+	if(e>=0) {
+		nhits++;
+		lru_unlink(e);
+		lru_push_front(e);
+	} else {
+		nmisses++;
+		e = insert(blocknum);
+	}
+	memcpy(entries[e].data,data,DISK_BLOCK_SIZE);
+	entries[e].dirty = 1;
+}
+
+/*
+Batched transfers for streams of blocks. Blocks already in the cache are
+served from (or updated in) their entries; the rest go to disk in one
+vectored call and are not added, so a large read or write does not push
+the metadata out of the cache.
+*/
+static void locked_readv( const int *blocknums, int n, char * const *data )
+{
+	int *missnums = malloc(n*sizeof(int));
+	char **missdata = malloc(n*sizeof(char*));
+	int nmiss = 0;
+
+	for(int i=0; i<n; i++) {
+		int e = capacity ? lookup(blocknums[i]) : -1;
+		if(e>=0) {
+			nhits++;
+			memcpy(data[i],entries[e].data,DISK_BLOCK_SIZE);
+		} else {
+			if(capacity) nmisses++;
+			missnums[nmiss] = blocknums[i];
+			missdata[nmiss] = data[i];
+			nmiss++;
+		}
+	}
+	disk_readv(missnums,nmiss,missdata);
+
+	free(missnums);
+	free(missdata);
+}
+
+static void locked_writev( const int *blocknums, int n, char * const *data )
+{
+	// Cached copies are refreshed and become clean, since the disk is written too
+	for(int i=0; capacity && i<n; i++) {
+		int e = lookup(blocknums[i]);
+		if(e>=0) {
+			memcpy(entries[e].data,data[i],DISK_BLOCK_SIZE);
+			entries[e].dirty = 0;
+		}
+	}
+	disk_writev(blocknums,n,data);
+}
+
+/*
+Read-only views of blocks for callers that only inspect them. A cached
+block is copied into scratch, since its entry may be recycled by the next
+cache call; otherwise the disk mapping is used directly when the image is
+memory mapped, and only without one is the block read into scratch.
+*/
+static const char *locked_view( int blocknum, char *scratch )
+{
+	int e = capacity ? lookup(blocknum) : -1;
+	if(e>=0) {
+		nhits++;
+		memcpy(scratch,entries[e].data,DISK_BLOCK_SIZE);
+		return scratch;
+	}
+
+	const char *view = disk_map(blocknum);
+	if(view) {
+		if(capacity) nmisses++;
+		return view;
+	}
+
+	locked_read(blocknum,scratch);
+	return scratch;
+}
+
+static void locked_viewv( const int *blocknums, int n, const char **views, char * const *scratch )
+{
+	int *missnums = malloc(n*sizeof(int));
+	char **missdata = malloc(n*sizeof(char*));
+	int nmiss = 0;
+
+	for(int i=0; i<n; i++) {
+		int e = capacity ? lookup(blocknums[i]) : -1;
+		if(e>=0) {
+			nhits++;
+			memcpy(scratch[i],entries[e].data,DISK_BLOCK_SIZE);
+			views[i] = scratch[i];
+			continue;
+		}
+
+		if(capacity) nmisses++;
+		views[i] = disk_map(blocknums[i]);
+		if(!views[i]) {
+			views[i] = scratch[i];
+			missnums[nmiss] = blocknums[i];
+			missdata[nmiss] = scratch[i];
+			nmiss++;
+		}
+	}
+	disk_readv(missnums,nmiss,missdata);
+
+	free(missnums);
+	free(missdata);
+}
+
+/*
+Drop cached copies without writing them back, for blocks whose old
+contents no longer matter, such as freed blocks handed out again as file
+data. The entries go to the cold end of the list to be reused first.
+*/
+static void locked_discard( const int *blocknums, int n )
+{
+	for(int i=0; capacity && i<n; i++) {
+		int e = lookup(blocknums[i]);
+		if(e<0) continue;
+		lru_unlink(e);
+		hash_remove(e);
+		entries[e].blocknum = -1;
+		entries[e].dirty = 0;
+		lru_push_back(e);
+	}
+}
+
+static void locked_flush()
+{
+	// Oldest first, so the write order roughly follows the order of updates
+	for(int e=lru_tail; e>=0; e=entries[e].prev) {
+		if(entries[e].dirty) {
+			disk_write(entries[e].blocknum,entries[e].data);
+			entries[e].dirty = 0;
+		}
+	}
+}
+
+/*
+Locked entry points. Callers get whole-block copies, or views into the
+disk mapping, so nothing they hold changes when the lock is dropped.
+*/
+void cache_read( int blocknum, char *data )
+{
+	pthread_mutex_lock(&lock);
+	locked_read(blocknum,data);
+	pthread_mutex_unlock(&lock);
+}
+
+void cache_write( int blocknum, const char *data )
+{
+	pthread_mutex_lock(&lock);
+	locked_write(blocknum,data);
+	pthread_mutex_unlock(&lock);
+}
+
+void cache_readv( const int *blocknums, int n, char * const *data )
+{
+	pthread_mutex_lock(&lock);
+	locked_readv(blocknums,n,data);
+	pthread_mutex_unlock(&lock);
+}
+
+void cache_writev( const int *blocknums, int n, char * const *data )
+{
+	pthread_mutex_lock(&lock);
+	locked_writev(blocknums,n,data);
+	pthread_mutex_unlock(&lock);
+}
+
+const char *cache_view( int blocknum, char *scratch )
+{
+	pthread_mutex_lock(&lock);
+	const char *view = locked_view(blocknum,scratch);
+	pthread_mutex_unlock(&lock);
+	return view;
+}
+
+void cache_viewv( const int *blocknums, int n, const char **views, char * const *scratch )
+{
+	pthread_mutex_lock(&lock);
+	locked_viewv(blocknums,n,views,scratch);
+	pthread_mutex_unlock(&lock);
+}
+
+void cache_discard( const int *blocknums, int n )
+{
+	pthread_mutex_lock(&lock);
+	locked_discard(blocknums,n);
+	pthread_mutex_unlock(&lock);
+}
+
+void cache_flush()
+{
+	pthread_mutex_lock(&lock);
+	locked_flush();
+	pthread_mutex_unlock(&lock);
+}
+
+void cache_close()
+{
+	if(entries) {
+		cache_flush();
+		printf("%d cache hits\n",nhits);
+		printf("%d cache misses\n",nmisses);
+	}
+	free(entries);
+	free(buckets);
+	entries = 0;
+	buckets = 0;
+	capacity = 0;
+	nused = 0;
+	lru_head = lru_tail = -1;
+}
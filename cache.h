@@ -0,0 +1,17 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#define CACHE_DEFAULT_BLOCKS 64
+
+int  cache_init( int capacity );
+void cache_read( int blocknum, char *data );
+void cache_write( int blocknum, const char *data );
+void cache_readv( const int *blocknums, int n, char * const *data );
+void cache_writev( const int *blocknums, int n, char * const *data );
+const char *cache_view( int blocknum, char *scratch );
+void cache_viewv( const int *blocknums, int n, const char **views, char * const *scratch );
+void cache_discard( const int *blocknums, int n );
+void cache_flush();
+void cache_close();
+
+#endif
@@ -1,26 +1,53 @@
 
+#define _GNU_SOURCE	// copy_file_range
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 
 #include "disk.h"
 
 #define DISK_MAGIC 0xdeadbeef
 
-static FILE *diskfile;
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static int diskfd = -1;
+static char *diskmap = 0;	// whole image, when opened with DISK_MMAP
 static int nblocks=0;
-static int nreads=0;
-static int nwrites=0;
+// Atomic, since the I/O queue's workers call in from several threads
+static _Atomic int nreads=0;
+static _Atomic int nwrites=0;
 
 int disk_init( const char *filename, int n )
 {
-	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
+	return disk_open(filename,n,0);
+}
+
+int disk_open( const char *filename, int n, int flags )
+{
+	diskfd = open(filename,O_RDWR|O_CREAT,0666);
+	if(diskfd<0) return 0;
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+	ftruncate(diskfd,(off_t)n*DISK_BLOCK_SIZE);
+
+	if(flags&DISK_MMAP) {
+		void *map = mmap(0,(size_t)n*DISK_BLOCK_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED,diskfd,0);
+		if(map==MAP_FAILED) {
+			close(diskfd);
+			diskfd = -1;
+			return 0;
+		}
+		diskmap = map;
+	}
 
 	nblocks = n;
 	nreads = 0;
@@ -52,41 +79,337 @@ static void sanity_check( int blocknum, const void *data )
 	}
 }
 
-void disk_read( int blocknum, char *data )
+static off_t block_offset( int blocknum )
 {
-	sanity_check(blocknum,data);
+	return (off_t)blocknum*DISK_BLOCK_SIZE;
+}
+
+static void io_error()
+{
+	printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+	abort();
+}
+
+// Move an iovec list in one or more preadv/pwritev calls, finishing short transfers
+static void transfer_iov( struct iovec *iov, int iovcnt, off_t offset, int writing )
+{
+	if(diskmap) {
+		for(int i=0; i<iovcnt; i++) {
+			if(writing) memcpy(diskmap+offset,iov[i].iov_base,iov[i].iov_len);
+			else memcpy(iov[i].iov_base,diskmap+offset,iov[i].iov_len);
+			offset += iov[i].iov_len;
+		}
+		return;
+	}
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	while(iovcnt>0) {
+		ssize_t n = writing ? pwritev(diskfd,iov,iovcnt,offset)
+		                    : preadv(diskfd,iov,iovcnt,offset);
+		if(n<0 && errno==EINTR) continue;
+		if(n<=0) io_error();
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
-	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
+		offset += n;
+		while(iovcnt>0 && (size_t)n>=iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt>0) {
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
 	}
 }
 
+static void transfer_run( int blocknum, int n, char *data, int writing )
+{
+	struct iovec iov;
+	iov.iov_base = data;
+	iov.iov_len = (size_t)n*DISK_BLOCK_SIZE;
+	transfer_iov(&iov,1,block_offset(blocknum),writing);
+}
+
+void disk_read( int blocknum, char *data )
+{
+	sanity_check(blocknum,data);
+	transfer_run(blocknum,1,data,0);
+	nreads++;
+}
+
 void disk_write( int blocknum, const char *data )
 {
 	sanity_check(blocknum,data);
+	transfer_run(blocknum,1,(char*)data,1);
+	nwrites++;
+}
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+void disk_read_run( int blocknum, int n, char *data )
+{
+	if(n<=0) return;
+	sanity_check(blocknum,data);
+	sanity_check(blocknum+n-1,data);
+	transfer_run(blocknum,n,data,0);
+	nreads += n;
+}
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
-	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
+void disk_write_run( int blocknum, int n, const char *data )
+{
+	if(n<=0) return;
+	sanity_check(blocknum,data);
+	sanity_check(blocknum+n-1,data);
+	transfer_run(blocknum,n,(char*)data,1);
+	nwrites += n;
+}
+
+// Scatter/gather: consecutive block numbers are merged into one preadv/pwritev
+static void transfer_vector( const int *blocknums, int n, char * const *data, int writing )
+{
+	struct iovec iov[IOV_MAX];
+	int i = 0;
+
+	while(i<n) {
+		int count = 0;
+		do {
+			sanity_check(blocknums[i+count],data[i+count]);
+			iov[count].iov_base = data[i+count];
+			iov[count].iov_len = DISK_BLOCK_SIZE;
+			count++;
+		} while(i+count<n && count<IOV_MAX && blocknums[i+count]==blocknums[i]+count);
+
+		transfer_iov(iov,count,block_offset(blocknums[i]),writing);
+		i += count;
 	}
 }
 
+void disk_readv( const int *blocknums, int n, char * const *data )
+{
+	transfer_vector(blocknums,n,data,0);
+	nreads += n;
+}
+
+void disk_writev( const int *blocknums, int n, char * const *data )
+{
+	transfer_vector(blocknums,n,data,1);
+	nwrites += n;
+}
+
+/*
+Zero-copy read access for the mmap backend: a pointer straight into the
+mapping, valid until disk_close. Returns null with the stdio-style backend,
+and callers then fall back to disk_read.
+*/
+const char *disk_map( int blocknum )
+{
+	if(!diskmap) return 0;
+	sanity_check(blocknum,diskmap);
+	nreads++;
+	return diskmap+block_offset(blocknum);
+}
+
+/*
+Views of several blocks for readers that may run on threads of their
+own: mapped blocks are used in place, the rest are read into scratch
+with one vectored call. Nothing here touches shared state beyond the
+counters, so concurrent callers are safe.
+*/
+void disk_viewv( const int *blocknums, int n, const char **views, char * const *scratch )
+{
+	int nmiss = 0;
+	int *missnums = malloc(n*sizeof(int));
+	char **missdata = malloc(n*sizeof(char*));
+
+	for(int i=0; i<n; i++) {
+		views[i] = disk_map(blocknums[i]);
+		if(!views[i]) {
+			views[i] = scratch[i];
+			missnums[nmiss] = blocknums[i];
+			missdata[nmiss] = scratch[i];
+			nmiss++;
+		}
+	}
+	disk_readv(missnums,nmiss,missdata);
+
+	free(missnums);
+	free(missdata);
+}
+
+/*
+Streaming between the image and a host file descriptor, at the
+descriptor's current offset. The kernel moves the bytes itself where it
+can: copy_file_range between regular files, sendfile out to pipes and
+sockets. Descriptors that support neither get plain reads and writes,
+straight into or out of the mapping when there is one and through a
+bounce buffer otherwise. Host errors are returned, not fatal.
+*/
+#define STREAM_BOUNCE (64*DISK_BLOCK_SIZE)
+
+// Whether a kernel copy failed only because these files don't support it
+static int stream_unsupported( int err )
+{
+	return err==EINVAL || err==EXDEV || err==ENOSYS || err==EOPNOTSUPP || err==EBADF;
+}
+
+static long send_plain( off_t offset, long length, int fd )
+{
+	char *bounce = diskmap ? 0 : malloc(STREAM_BOUNCE);
+	long done = 0;
+
+	while(done<length) {
+		long chunk = length-done;
+		const char *data;
+		if(diskmap) {
+			data = diskmap+offset+done;
+		} else {
+			if(chunk>STREAM_BOUNCE) chunk = STREAM_BOUNCE;
+			struct iovec iov = { bounce, chunk };
+			transfer_iov(&iov,1,offset+done,0);
+			data = bounce;
+		}
+		for(long sent=0; sent<chunk; ) {
+			ssize_t n = write(fd,data+sent,chunk-sent);
+			if(n<0 && errno==EINTR) continue;
+			if(n<=0) {
+				free(bounce);
+				return -1;
+			}
+			sent += n;
+		}
+		done += chunk;
+	}
+	free(bounce);
+	return done;
+}
+
+/*
+Send length bytes of the image, starting at blocknum. Returns the bytes
+sent, or -1 if the descriptor fails.
+*/
+long disk_send( int blocknum, long length, int fd )
+{
+	if(length<=0) return 0;
+	sanity_check(blocknum,&fd);
+	sanity_check(blocknum+(length-1)/DISK_BLOCK_SIZE,&fd);
+
+	off_t offset = block_offset(blocknum);
+	long done = 0;
+	int method = 0;	// copy_file_range, then sendfile, then plain writes
+
+	while(done<length && method<2) {
+		ssize_t n = method==0 ? copy_file_range(diskfd,&offset,fd,0,length-done,0)
+		                      : sendfile(fd,diskfd,&offset,length-done);
+		if(n<0 && errno==EINTR) continue;
+		if(n<0 && !stream_unsupported(errno)) return -1;
+		if(n<=0) method++;
+		else done += n;
+	}
+	if(done<length) {
+		long n = send_plain(offset,length-done,fd);
+		if(n<0) return -1;
+		done += n;
+	}
+	nreads += (length+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE;
+	return done;
+}
+
+// Read until the descriptor runs dry, returning the bytes read, or -1
+static long receive_plain( off_t offset, long length, int fd )
+{
+	char *bounce = diskmap ? 0 : malloc(STREAM_BOUNCE);
+	long done = 0;
+
+	while(done<length) {
+		long chunk = length-done;
+		char *data = diskmap ? diskmap+offset+done : bounce;
+		if(!diskmap && chunk>STREAM_BOUNCE) chunk = STREAM_BOUNCE;
+
+		long got = 0;
+		while(got<chunk) {
+			ssize_t n = read(fd,data+got,chunk-got);
+			if(n<0 && errno==EINTR) continue;
+			if(n<0) {
+				free(bounce);
+				return -1;
+			}
+			if(n==0) break;
+			got += n;
+		}
+		if(!diskmap && got>0) {
+			struct iovec iov = { bounce, got };
+			transfer_iov(&iov,1,offset+done,1);
+		}
+		done += got;
+		if(got<chunk) break;
+	}
+	free(bounce);
+	return done;
+}
+
+/*
+Fill length bytes of the image, starting at blocknum, from the
+descriptor. Whatever the descriptor runs out before is zeroed. Returns
+the bytes read, or -1 if the descriptor fails.
+*/
+long disk_receive( int blocknum, long length, int fd )
+{
+	if(length<=0) return 0;
+	sanity_check(blocknum,&fd);
+	sanity_check(blocknum+(length-1)/DISK_BLOCK_SIZE,&fd);
+
+	off_t offset = block_offset(blocknum);
+	off_t start = offset;
+	long done = 0;
+	int plain = 0;
+
+	while(done<length) {
+		ssize_t n = copy_file_range(fd,0,diskfd,&offset,length-done,0);
+		if(n<0 && errno==EINTR) continue;
+		if(n<0 && !stream_unsupported(errno)) return -1;
+		if(n<0) plain = 1;
+		if(n<=0) break;
+		done += n;
+	}
+	if(plain) {
+		long n = receive_plain(offset,length-done,fd);
+		if(n<0) return -1;
+		done += n;
+	}
+
+	if(done<length) {
+		if(diskmap) {
+			memset(diskmap+start+done,0,length-done);
+		} else {
+			char *zeros = calloc(1,length-done);
+			struct iovec iov = { zeros, length-done };
+			transfer_iov(&iov,1,start+done,1);
+			free(zeros);
+		}
+	}
+	nwrites += (length+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE;
+	return done;
+}
+
+/*
+Wait until everything written so far is on stable storage, for callers
+that depend on the order in which writes reach it.
+*/
+void disk_sync()
+{
+	if(diskfd<0) return;
+	if(diskmap && msync(diskmap,(size_t)nblocks*DISK_BLOCK_SIZE,MS_SYNC)) io_error();
+	if(fdatasync(diskfd)) io_error();
+}
+
 void disk_close()
 {
-	if(diskfile) {
+	if(diskfd>=0) {
 		printf("%d disk block reads\n",nreads);
 		printf("%d disk block writes\n",nwrites);
-		fclose(diskfile);
-		diskfile = 0;
+		if(diskmap) {
+			msync(diskmap,(size_t)nblocks*DISK_BLOCK_SIZE,MS_SYNC);
+			munmap(diskmap,(size_t)nblocks*DISK_BLOCK_SIZE);
+			diskmap = 0;
+		}
+		close(diskfd);
+		diskfd = -1;
 	}
 }
-
@@ -3,10 +3,23 @@
 
 #define DISK_BLOCK_SIZE 4096
 
+// disk_open flags
+#define DISK_MMAP 1	// map the image instead of reading and writing it
+
 int  disk_init( const char *filename, int nblocks );
+int  disk_open( const char *filename, int nblocks, int flags );
 int  disk_size();
 void disk_read( int blocknum, char *data );
 void disk_write( int blocknum, const char *data );
+void disk_read_run( int blocknum, int n, char *data );
+void disk_write_run( int blocknum, int n, const char *data );
+void disk_readv( const int *blocknums, int n, char * const *data );
+void disk_writev( const int *blocknums, int n, char * const *data );
+const char *disk_map( int blocknum );
+void disk_viewv( const int *blocknums, int n, const char **views, char * const *scratch );
+long disk_send( int blocknum, long length, int fd );
+long disk_receive( int blocknum, long length, int fd );
+void disk_sync();
 void disk_close();
 
 
@@ -1,5 +1,9 @@
 #include "fs.h"
 #include "disk.h"
+#include "cache.h"
+#include "bitmap.h"
+#include "ioq.h"
+#include "lz.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -8,38 +12,397 @@
 #include <unistd.h>
 #include <math.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #define FS_MAGIC           0xf0f03410
-#define INODES_PER_BLOCK   128
+#define FS_VERSION         2	// 1: 64-byte inodes with double and triple indirect pointers, 2: journal
+#define INODE_SIZE_V0      32
+#define INODE_SIZE         64
+#define INODE_SIZE_INLINE  256	// with FS_INLINE, leaving 192 bytes for data
 #define POINTERS_PER_INODE 5
 #define POINTERS_PER_BLOCK 1024
 #define DATA_BLOCK_SIZE    4096
+#define BMAP_DEPTH         3	// most levels of pointer blocks above a data block
+#define INLINE_EXTENTS     2	// extents held in the inode itself
+#define BITS_PER_BLOCK     (DISK_BLOCK_SIZE*8)
+#define IO_BATCH           64	// blocks per vectored disk transfer
+#define WRITE_BEHIND       32	// data blocks fs_write may leave in flight
+#define RA_STREAMS         4	// files whose sequential reads are tracked at once
+#define RA_MIN             4	// first read-ahead window, in blocks
+#define RA_MAX             64	// largest window, doubled per sequential read
+#define SCAN_THREADS       8	// most threads rebuilding the free map at mount
+#define SCAN_MIN_IBLOCKS   16	// fewest inode blocks worth a thread of their own
+#define SCAN_POINTER       (1 << 30)	// flag on the counts of pointer blocks found
+#define INODE_LOCKS        64	// reader/writer locks shared out among the inodes
+#define DELALLOC_BUFFERS   16	// files whose new blocks may be buffered at once
+#define DELALLOC_MAX       64	// new blocks buffered per file before they are placed
+#define STREAM_BLOCKS      1024	// blocks fs_import and fs_export move per hold of the inode lock
+#define OPEN_FILES         64	// handles fs_open may give out at once
+#define JOURNAL_MIN        16	// smallest journal worth reserving, in blocks
+#define JOURNAL_MAX        4096
+#define JOURNAL_BUCKETS    1024	// hash chains for blocks in the running transaction
+#define JOURNAL_AGE        5	// seconds between commits by the flusher
+#define JOURNAL_HEADER     0x4a4e4c48
+#define JOURNAL_DESCRIPTOR 0x4a4e4c44
+#define JOURNAL_COMMIT     0x4a4e4c43
+#define DIR_MAGIC          0x44495248
+#define DIR_TABLE_BLOCKS   8	// directory file blocks 1.. holding the bucket table
+#define DIR_DEPTH_MAX      13	// hash bits the table can use, 2^13 slots filling it
+#define DIR_FIRST_BUCKET   (1 + DIR_TABLE_BLOCKS)
+#define INODE_FILE         0
+#define INODE_DIR          1
+#define CLUSTER_BLOCKS     8	// file blocks compressed together
+#define CLUSTER_SIZE       (CLUSTER_BLOCKS*DATA_BLOCK_SIZE)
+#define CLUSTER_LZ         1
+#define CLUSTER_STORED     2
 
 struct fs_superblock {
 	int magic;
 	int nblocks;
 	int ninodeblocks;
 	int ninodes;
+	// Zero on file systems formatted before versioning (32-byte inodes)
+	int version;
+	int inode_size;
+	int flags;	// FS_EXTENTS and friends, chosen by fs_format_with
+	// Free block map kept on disk after the inode table, none if zero blocks
+	int bitmap_start;
+	int nbitmapblocks;
+	int clean;	// set at unmount, so the map on disk can be trusted
+	// Version 2 and later: metadata journal after the free block map
+	int journal_start;
+	int njournalblocks;
+	int root;	// FS_DIRECTORIES: inumber of the root directory
+	// FS_DEDUP: table of shared data blocks after the journal
+	int dedup_start;
+	int ndedupblocks;
 };
 
+#define JOURNAL_SLOTS      (DISK_BLOCK_SIZE/(int)sizeof(int) - 4)
+
+/*
+Blocks of the journal region. The header, in its first block, holds the
+sequence number of the next transaction to replay. A transaction follows
+it as descriptor blocks, each listing where the next nblocks logged
+blocks belong, and ends with a commit block that covers them all.
+*/
+struct fs_journal_block {
+	int magic;
+	int sequence;
+	int nblocks;
+	unsigned checksum;	// commit blocks only
+	int blocknums[JOURNAL_SLOTS];
+};
+
+// File blocks [logical, logical+length) stored at disk blocks from start on
+struct fs_extent {
+	int logical;
+	int start;
+	int length;
+};
+
+#define EXTENTS_PER_BLOCK  ((int)(DISK_BLOCK_SIZE / sizeof(struct fs_extent)))
+
 struct fs_inode {
 	int isvalid;
-	int size;
-	int direct[POINTERS_PER_INODE];
-	int indirect;
+	int size;	// low half of the size from version 1 on
+	union {
+		struct {
+			int direct[POINTERS_PER_INODE];
+			int indirect;
+			// Version 1 and later only, version 0 inodes end here
+			int dindirect;
+			int tindirect;
+		};
+		// File systems formatted with FS_EXTENTS, extents sorted by logical
+		struct {
+			struct fs_extent extent[INLINE_EXTENTS];
+			int extent_block;	// index of extent blocks, 0 while they fit inline
+			int nextents;
+		};
+	};
+	int size_hi;
+	// With FS_DIRECTORIES
+	int type;	// INODE_FILE or INODE_DIR
+	int parent;	// directory holding its name, 0 for unnamed files
+	// With FS_INLINE
+	int inlined;	// data kept in the record after the inode, not in blocks
+	// With FS_COMPRESS
+	int compressed;	// data kept in compressed clusters
+	int stored;	// data blocks a compressed file holds
+};
+
+/*
+Directories are extendible hash tables kept in their own file blocks.
+Block 0 is the header, blocks 1..DIR_TABLE_BLOCKS a table from the low
+depth bits of a name's hash to its bucket, and bucket i is file block
+DIR_FIRST_BUCKET+i. A full bucket splits in two on the next bit of the
+hash, doubling the table first if the bucket already uses every bit the
+table does, so a lookup reads one table block and one bucket however
+large the directory grows.
+*/
+struct fs_dirent {
+	int inumber;
+	char name[FS_NAME_MAX+1];
+};
+
+#define DIRENTS_PER_BLOCK  ((DISK_BLOCK_SIZE - 2*(int)sizeof(int)) / (int)sizeof(struct fs_dirent))
+
+struct fs_dirheader {
+	int magic;
+	int depth;	// hash bits the table uses
+	int nbuckets;
+	int nentries;
+};
+
+struct fs_dirbucket {
+	int depth;	// hash bits its names have in common
+	int count;
+	struct fs_dirent entries[DIRENTS_PER_BLOCK];
 };
 
+/*
+Compressed files keep their data in clusters of CLUSTER_BLOCKS file
+blocks. A cluster that compresses into fewer blocks is stored in its
+first slots of the block map, starting with this header, and always
+leaves its last slot a hole; one that does not is stored as it is, in
+every slot. A cluster with no first block is a hole.
+*/
+struct fs_cluster {
+	int method;	// CLUSTER_LZ, or CLUSTER_STORED for data kept as it is
+	int length;	// bytes after the header
+	int size;	// bytes of file data they hold
+};
+
+/*
+The dedup table of FS_DEDUP file systems has an entry per disk block,
+counting the slots pointing at it in inodes and pointer blocks. A data
+block written through the table has the hash of its contents, never 0,
+and a count from 1; a block shared by clones without one, such as a
+pointer block, counts from 2. Any other block has refs 0 and one user.
+*/
+struct fs_dedup {
+	uint64_t hash;
+	int refs;
+	int unused;
+};
+
+#define DEDUP_PER_BLOCK    ((int)(DISK_BLOCK_SIZE / sizeof(struct fs_dedup)))
+
 union fs_block {
 	struct fs_superblock super;
-	struct fs_inode inode[INODES_PER_BLOCK];
 	int pointers[POINTERS_PER_BLOCK];
+	struct fs_extent extents[EXTENTS_PER_BLOCK];
+	struct fs_journal_block journal;
+	struct fs_dirheader dir;
+	struct fs_dirbucket bucket;
+	struct fs_dedup dedup[DEDUP_PER_BLOCK];
 	char data[DISK_BLOCK_SIZE];
 };
 
-int *bitmap;
+/*
+Pointer blocks on the way from an inode to its data, as last looked up.
+On extent file systems the cursor instead holds the whole extent list,
+with the index of extent blocks at level 0.
+*/
+struct bmap_cursor {
+	int blocknum[BMAP_DEPTH];	// block held at each level, 0 if none
+	bool dirty[BMAP_DEPTH];
+	union fs_block level[BMAP_DEPTH];
+	struct fs_extent *extents;	// 0 until loaded
+	int nextents;
+	int capacity;
+	int first_dirty;	// first extent changed since loading
+};
+
+// A directory being read or changed, and the cursor mapping its blocks
+struct dir {
+	int inumber;
+	struct fs_inode *inode;
+	struct bmap_cursor cursor;
+	union fs_block header;
+};
+
+// Blocks reserved for a write and not yet handed out
+struct run {
+	int start;
+	int left;
+	int want;	// size of the next run to reserve
+	int credit;	// blocks set aside earlier that the run may draw on
+};
+
+// Blocks freed by deletes, returned to the freemap together
+struct free_run {
+	int start;
+	int length;
+};
+
+struct free_list {
+	struct free_run *runs;
+	int n;
+	int capacity;
+};
+
+// A metadata block changed in the running transaction
+struct journal_entry {
+	int blocknum;
+	int hnext;	// next entry in the same hash chain
+	union fs_block block;
+};
+
+/*
+The running transaction: the latest copy of every metadata block changed
+since the last commit, and the blocks freed along the way, which are not
+handed out again until the transaction is safely on disk. Operations
+hold a handle on it while they make changes, and a commit waits for the
+handles to be given back, so it only ever sees whole operations.
+*/
+struct journal {
+	struct journal_entry *entries;
+	int n;
+	int capacity;
+	int buckets[JOURNAL_BUCKETS];
+	struct free_list freed;
+	int handles;	// operations in progress
+	bool committing;
+	int sequence;	// of the transaction to commit next
+};
+
+/*
+Locking. Every call holds fs_lock, shared except for format, mount,
+unmount and debug, which have the file system to themselves. Calls that
+change metadata then take a journal handle, and calls on a file its
+inode lock, shared for reading and exclusive for changes; inodes share
+INODE_LOCKS locks by inumber. The leaf locks below them guard one
+structure each and are never held while taking another.
+*/
+pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t inode_locks[INODE_LOCKS];
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;	// freemap
+pthread_mutex_t create_lock = PTHREAD_MUTEX_INITIALIZER;	// inodemap
+pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;	// ra_streams slots
+pthread_mutex_t delalloc_lock = PTHREAD_MUTEX_INITIALIZER;	// delalloc_buffers slots
+pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;	// handles slots
+pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;	// io_wait counts, wb_slots
+pthread_cond_t io_done = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;	// journal
+pthread_cond_t journal_idle = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;	// flusher_running
+pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;	// dedup table and index
+
+struct bitmap freemap;	// set bit = free block
+struct journal journal;
+pthread_t flusher;
+bool flusher_running;	// while a journaled file system is mounted
+struct bitmap inodemap;	// set bit = free inode, built at mount
 int mounted = 0;
 
-void print_valid_blocks(int array[], int size){
+/*
+Queued disk operations are tagged with the io_wait of whoever needs
+them done, and counted off by whichever thread reaps them, so a thread
+can wait for its own operations alone.
+*/
+struct io_wait {
+	int pending;
+};
+
+// Buffers for data blocks queued by fs_write, busy until their write completes
+struct wb_slot {
+	struct io_wait wait;	// the queued write, while busy
+	int inumber;		// file the block belongs to
+	int blocknum;		// where it goes, 0 until queued
+	char data[DATA_BLOCK_SIZE];
+};
+struct wb_slot wb_slots[WRITE_BEHIND];
+
+/*
+Read-ahead state for a file being read sequentially. Prefetched blocks sit
+in a ring indexed by file block number modulo RA_MAX, covering blocks
+[start, start+count). The file's pointer blocks are kept in the cursor
+so consecutive calls do not fetch them again.
+*/
+struct readahead {
+	int inumber;		// 0 when the slot is unused
+	long next_offset;	// where a sequential reader continues
+	int window;
+	int start;
+	int count;
+	struct bmap_cursor cursor;
+	char *ring;
+	struct io_wait wait;	// prefetches into the ring
+	bool busy;		// in use by a reader
+	int last_use;
+};
+struct readahead ra_streams[RA_STREAMS];
+int ra_clock = 0;
+
+/*
+Delayed allocation. New blocks written to a file collect in a buffer,
+without disk blocks, until it can grow no further or the journal
+commits; then they are placed all at once, as one run where the disk
+allows, and the pointer blocks are written once for the lot. Buffered
+blocks cover file blocks [first, first+count), none of them mapped, and
+blocks enough to hold them are set aside in delalloc_reserved, so the
+writes that filled the buffer cannot fail later for lack of space. A
+buffer belongs to its file's inode lock while inumber is set.
+*/
+struct delalloc {
+	int inumber;	// 0 when the buffer is unused
+	long first;
+	int count;
+	int reserved;	// blocks set aside for this buffer
+	char *data;	// DELALLOC_MAX blocks
+};
+struct delalloc delalloc_buffers[DELALLOC_BUFFERS];
+int delalloc_reserved = 0;	// set aside for all buffers, under alloc_lock
+
+/*
+Open files. A handle keeps its file's position and, in a read-ahead state
+of its own, the pointer blocks or extents it last mapped the file with,
+so calls through it look nothing up again that has not changed. Under
+the inode lock it checks the file's change and delete counts against the
+ones it last saw: a change drops the cached map and prefetched blocks,
+and a delete leaves the handle with nothing to read or write. A handle
+is used by one thread at a time.
+*/
+struct handle {
+	int inumber;	// 0 when the handle is unused
+	struct fs_inode *inode;
+	long position;
+	int changes;	// inode_changes when the cached map was last known good
+	int deletes;	// inode_deletes when opened
+	bool written;
+	struct readahead ra;
+};
+struct handle handles[OPEN_FILES];
+
+// Loaded by fs_mount and kept until fs_unmount
+struct fs_superblock super;
+int inodes_per_block;
+union fs_block *inode_table;	// copy of inode blocks 1..ninodeblocks
+char *inode_dirty;		// one flag per inode block
+int inode_ndirty;		// flags set in inode_dirty
+int *inode_changes;		// per inode, bumped when its blocks or map change
+int *inode_deletes;		// per inode, bumped when it is deleted
+
+/*
+With FS_DEDUP the dedup table stays in memory too, and an open addressing
+index, with linear probing, finds the blocks in it by hash. A block that
+loses one of its users is noted in dedup_unshared until the next commit,
+since until then a crash would leave the old user pointing at it again.
+*/
+union fs_block *dedup_table;	// copy of the table blocks
+char *dedup_dirty;		// one flag per table block
+int dedup_ndirty;		// flags set in dedup_dirty
+int *dedup_index;		// block numbers, 0 for an empty slot
+int dedup_nslots;		// a power of two, over twice the blocks
+struct bitmap dedup_unshared;
+
+void print_valid_blocks(const int array[], int size){
 	for(int i=0; i< size; i++){
 		if(array[i] == 0){ //points to a null block
 			continue;
@@ -57,512 +420,4147 @@ int inumberValid(int inumber, int ninodes) {
 	return (inumber > 0 && inumber < ninodes);
 }
 
+// Bytes per inode record; version 0 file systems predate the field
+int super_inode_size(const struct fs_superblock *sb) {
+	return sb->version >= 1 ? sb->inode_size : INODE_SIZE_V0;
+}
+
 int get_iblock(int inumber){
-	return inumber/INODES_PER_BLOCK+1;
+	return inumber/inodes_per_block+1;
 }
 
-int get_inum(int iblock, int inode_index) {
-	return (iblock - 1)*INODES_PER_BLOCK + inode_index;
+int get_inum(int iblock, int inode_index, int ipb) {
+	return (iblock - 1)*ipb + inode_index;
 }
 
-int find_free_block(int nblocks) {
-	for (int i = 1; i < nblocks; i++) {
-		if (bitmap[i] == 1) {
-			return i;
+int find_free_block() {
+	return bitmap_find_set(&freemap);
+}
+
+int get_inode_index(int inumber) {
+	return inumber % inodes_per_block;
+}
+
+long inode_getsize(const struct fs_inode *inode, int version) {
+	if (version < 1)
+		return inode->size;
+	return ((long)(unsigned)inode->size_hi << 32) | (unsigned)inode->size;
+}
+
+void inode_setsize(struct fs_inode *inode, long size) {
+	inode->size = (int)size;
+	if (super.version >= 1)
+		inode->size_hi = (int)(size >> 32);
+}
+
+// Largest file, in blocks, that the pointers of an inode can map
+long max_file_blocks(int version) {
+	long n = POINTERS_PER_INODE + POINTERS_PER_BLOCK;
+	if (version >= 1)
+		n += (long)POINTERS_PER_BLOCK*POINTERS_PER_BLOCK
+		   + (long)POINTERS_PER_BLOCK*POINTERS_PER_BLOCK*POINTERS_PER_BLOCK;
+	return n;
+}
+
+// Read count consecutive blocks into data, IO_BATCH blocks per transfer
+void read_blocks(int blocknum, int count, char *data) {
+	int blocknums[IO_BATCH];
+	char *buffers[IO_BATCH];
+
+	for (int done = 0; done < count; done += IO_BATCH) {
+		int n = count - done < IO_BATCH ? count - done : IO_BATCH;
+		for (int i = 0; i < n; i++) {
+			blocknums[i] = blocknum + done + i;
+			buffers[i] = data + (done + i)*DISK_BLOCK_SIZE;
 		}
+		cache_readv(blocknums, n, buffers);
 	}
-	return -1;
 }
 
-int get_inode_index(int inumber) {
-	return inumber % INODES_PER_BLOCK;
+void write_blocks(int blocknum, int count, char *data) {
+	int blocknums[IO_BATCH];
+	char *buffers[IO_BATCH];
+
+	for (int done = 0; done < count; done += IO_BATCH) {
+		int n = count - done < IO_BATCH ? count - done : IO_BATCH;
+		for (int i = 0; i < n; i++) {
+			blocknums[i] = blocknum + done + i;
+			buffers[i] = data + (done + i)*DISK_BLOCK_SIZE;
+		}
+		cache_writev(blocknums, n, buffers);
+	}
 }
 
-void fs_debug()
-{
+void io_submit_read(int blocknum, char *data, struct io_wait *wait) {
+	pthread_mutex_lock(&io_lock);
+	wait->pending++;
+	pthread_mutex_unlock(&io_lock);
+	ioq_submit_read(blocknum, data, wait);
+}
 
-	union fs_block block;
-	union fs_block indirect_block;
+// Queue a block claimed with wb_slot_get. Threads waiting for a buffer
+// are woken, since there is now a completion for them to reap.
+void io_submit_write(int blocknum, struct wb_slot *slot) {
+	ioq_submit_write(blocknum, slot->data, &slot->wait);
+	pthread_mutex_lock(&io_lock);
+	slot->blocknum = blocknum;
+	pthread_cond_broadcast(&io_done);
+	pthread_mutex_unlock(&io_lock);
+}
 
-	// Read in super block
-	disk_read(0,block.data);
+// Reap one completion, whoever it belongs to. Returns 0 if none was queued.
+int io_reap_one() {
+	void *tag;
+	if (!ioq_reap(&tag))
+		return 0;
 
-	//int magic = block.super.magic;
-	int validSuperblock = check_magic(block.super.magic);
+	pthread_mutex_lock(&io_lock);
+	((struct io_wait *)tag)->pending--;
+	pthread_cond_broadcast(&io_done);
+	pthread_mutex_unlock(&io_lock);
+	return 1;
+}
 
-	printf("superblock:\n");
-	if(validSuperblock)
-		printf("    magic number is valid\n");
-	else{
-		printf("    magic number is not valid\n");
-		return;
+/*
+Wait until the operations counted in wait have completed. With nothing
+left to reap, the last of them is in the hands of another thread, which
+signals io_done once it has counted it off.
+*/
+void io_wait(struct io_wait *wait) {
+	pthread_mutex_lock(&io_lock);
+	while (wait->pending > 0) {
+		pthread_mutex_unlock(&io_lock);
+		int reaped = io_reap_one();
+		pthread_mutex_lock(&io_lock);
+		if (!reaped && wait->pending > 0)
+			pthread_cond_wait(&io_done, &io_lock);
 	}
-	printf("    %d blocks\n",block.super.nblocks);
-	printf("    %d inode blocks\n",block.super.ninodeblocks);
-	printf("    %d inodes\n",block.super.ninodes);
+	pthread_mutex_unlock(&io_lock);
+}
 
-	// Traversing inode blocks
-	for(int i=1; i<=block.super.ninodeblocks; i++){ //added equal
-		// Read in inode block
-		disk_read(i, block.data);
+// Wait for the blocks of a file still being written behind
+void io_wait_inode(int inumber) {
+	for (int i = 0; i < WRITE_BEHIND; i++) {
+		pthread_mutex_lock(&io_lock);
+		bool match = wb_slots[i].wait.pending > 0 && wb_slots[i].inumber == inumber;
+		pthread_mutex_unlock(&io_lock);
+		if (match)
+			io_wait(&wb_slots[i].wait);
+	}
+}
 
-		// Traverse inodes
-		for(int j = 0; j<INODES_PER_BLOCK; j++) {
-			// Check if inode is valid
-			if(block.inode[j].isvalid) {
-				int inumber = get_inum(i, j);
-				printf("inode %d:\n", inumber);
-				printf("    size: %d bytes\n", block.inode[j].size);
+// Wait for everything in flight, so the disk is current
+void io_drain() {
+	while (io_reap_one()) {
+	}
+}
 
-				// Traverse direct pointers
-				if(block.inode[j].size > 0){
-					printf("    direct blocks: ");
-					print_valid_blocks(block.inode[j].direct, POINTERS_PER_INODE);
-				}
+// Claim a free write-behind buffer for a block of inumber
+char *wb_slot_get(int inumber, struct wb_slot **slot) {
+	int reaped = 1;
 
-				// Traverse indirect pointers
-				if(block.inode[j].indirect != 0){
-					printf("    indirect block: %d\n", block.inode[j].indirect);
-					printf("    indirect data blocks: ");
-					disk_read(block.inode[j].indirect, indirect_block.data);
-					print_valid_blocks(indirect_block.pointers, POINTERS_PER_BLOCK);
-				}
+	pthread_mutex_lock(&io_lock);
+	while (1) {
+		for (int i = 0; i < WRITE_BEHIND; i++) {
+			if (wb_slots[i].wait.pending == 0) {
+				wb_slots[i].wait.pending = 1;
+				wb_slots[i].inumber = inumber;
+				wb_slots[i].blocknum = 0;
+				pthread_mutex_unlock(&io_lock);
+				*slot = &wb_slots[i];
+				return wb_slots[i].data;
 			}
 		}
-
+		// Nothing left to reap: other threads hold the completions, or
+		// buffers not yet queued, and signal io_done once they are
+		if (!reaped) {
+			pthread_cond_wait(&io_done, &io_lock);
+			reaped = 1;
+			continue;
+		}
+		pthread_mutex_unlock(&io_lock);
+		reaped = io_reap_one();
+		pthread_mutex_lock(&io_lock);
 	}
 }
 
-int fs_format() {
-	//Read in super block
-	union fs_block block;
-	disk_read(0, block.data);
-
-	//Check if FS already mounted
-	if ( mounted ){
-		printf("FS is already mounted, format failed\n");
-	 	return 0;
+// Make sure a reservation holds a block, reserving a new run once it is
+// used up. Returns 0 when the disk is full.
+int run_fill(struct run *run) {
+	if (run->left == 0) {
+		pthread_mutex_lock(&alloc_lock);
+		// Blocks set aside for buffers are only for those buffers' runs
+		int spare = freemap.nset - delalloc_reserved + run->credit;
+		int want = run->want < spare ? run->want : spare;
+		if (want > 0)
+			run->start = bitmap_alloc_run(&freemap, want, &run->left);
+		int used = run->left < run->credit ? run->left : run->credit;
+		run->credit -= used;
+		delalloc_reserved -= used;
+		pthread_mutex_unlock(&alloc_lock);
 	}
+	return run->left > 0;
+}
 
-	//Create superblock, prepare for mount
-	int ninodeblocks = ceil(.1 * (double)disk_size());
-	block.super.magic = FS_MAGIC;
-	block.super.nblocks = disk_size();
-	block.super.ninodeblocks = ninodeblocks;
-	block.super.ninodes = INODES_PER_BLOCK * ninodeblocks;
+// Set n blocks aside for a delayed allocation, if that many are spare
+bool blocks_reserve(int n) {
+	pthread_mutex_lock(&alloc_lock);
+	bool ok = freemap.nset - delalloc_reserved >= n;
+	if (ok)
+		delalloc_reserved += n;
+	pthread_mutex_unlock(&alloc_lock);
+	return ok;
+}
 
-	// Write changes to disk
-	disk_write(0, block.data);
+void blocks_unreserve(int n) {
+	pthread_mutex_lock(&alloc_lock);
+	delalloc_reserved -= n;
+	pthread_mutex_unlock(&alloc_lock);
+}
 
-	//Clear the inode table
-	union fs_block iblock;
-	for(int i=1; i<=block.super.ninodeblocks; i++){
-		// Read in inode block
-		disk_read(i, iblock.data);
-		for(int j=0; j<INODES_PER_BLOCK; j++){
-			iblock.inode[j].isvalid = 0;
+// Return blocks to the free map
+void blocks_free(int start, int length) {
+	pthread_mutex_lock(&alloc_lock);
+	bitmap_set_run(&freemap, start, length);
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+// Note blocks to free, merging with the last run when they follow on
+void free_list_add(struct free_list *fl, int start, int length) {
+	if (fl->n > 0) {
+		struct free_run *last = &fl->runs[fl->n - 1];
+		if (last->start + last->length == start) {
+			last->length += length;
+			return;
 		}
-		disk_write(i, iblock.data);
 	}
+	if (fl->n == fl->capacity) {
+		fl->capacity = fl->capacity ? 2*fl->capacity : 16;
+		fl->runs = realloc(fl->runs, fl->capacity*sizeof(struct free_run));
+	}
+	fl->runs[fl->n].start = start;
+	fl->runs[fl->n].length = length;
+	fl->n++;
+}
 
-	return 1;
+// Free everything on the list under one hold of alloc_lock
+void free_list_apply(struct free_list *fl) {
+	pthread_mutex_lock(&alloc_lock);
+	for (int i = 0; i < fl->n; i++) {
+		bitmap_set_run(&freemap, fl->runs[i].start, fl->runs[i].length);
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	free(fl->runs);
+	fl->runs = 0;
+	fl->n = 0;
+	fl->capacity = 0;
 }
 
-int fs_mount()
-{
-	// Read in the super block
-	union fs_block block;
-	disk_read(0, block.data);
+// Journaled file systems keep metadata changes in the journal until commit
+bool journaling() {
+	return super.njournalblocks > 0;
+}
 
-	//Check if file system present
-	if (!check_magic(block.super.magic)){
-		printf("Error: Filesystem is not present on disk\n");
-		return 0;
+// Entry of the running transaction for blocknum, -1 if there is none
+int journal_find(int blocknum) {
+	for (int e = journal.buckets[blocknum % JOURNAL_BUCKETS]; e >= 0; e = journal.entries[e].hnext) {
+		if (journal.entries[e].blocknum == blocknum)
+			return e;
 	}
+	return -1;
+}
 
-	//Check if mounted already
-	if (mounted){
-		printf("Error: FS is already mounted. Mount failed\n");
-		return 0;
+// Write a metadata block, through the journal when there is one
+void meta_write(int blocknum, const char *data) {
+	if (!journaling()) {
+		cache_write(blocknum, data);
+		return;
 	}
 
-	//Build free block bitmap
-	int nblocks = block.super.nblocks;
-	bitmap = malloc(nblocks*sizeof(int));
-
-	//Initialize to free - 1s
-	for(int i=1; i<nblocks; i++){
-		bitmap[i] = 1;
+	pthread_mutex_lock(&journal_lock);
+	int e = journal_find(blocknum);
+	if (e < 0) {
+		if (journal.n == journal.capacity) {
+			journal.capacity = journal.capacity ? 2*journal.capacity : 64;
+			journal.entries = realloc(journal.entries, journal.capacity*sizeof(struct journal_entry));
+		}
+		e = journal.n++;
+		journal.entries[e].blocknum = blocknum;
+		journal.entries[e].hnext = journal.buckets[blocknum % JOURNAL_BUCKETS];
+		journal.buckets[blocknum % JOURNAL_BUCKETS] = e;
 	}
+	memcpy(journal.entries[e].block.data, data, DISK_BLOCK_SIZE);
+	pthread_mutex_unlock(&journal_lock);
+}
 
-	bitmap[0] = 0;	// Super block is never free
-	//Setting inode blocks to not free
-	for (int j=1; j<=block.super.ninodeblocks; j++){
-		bitmap[j] = 0;
+/*
+Read-only view of a metadata block, as cache_view, but seeing changes
+still waiting in the journal. Those are copied into scratch.
+*/
+const char *meta_view(int blocknum, char *scratch) {
+	if (journaling()) {
+		pthread_mutex_lock(&journal_lock);
+		int e = journal_find(blocknum);
+		if (e >= 0)
+			memcpy(scratch, journal.entries[e].block.data, DISK_BLOCK_SIZE);
+		pthread_mutex_unlock(&journal_lock);
+		if (e >= 0)
+			return scratch;
 	}
+	return cache_view(blocknum, scratch);
+}
 
-	union fs_block iblock;
-	union fs_block indirect_block;
+void meta_read(int blocknum, char *data) {
+	const char *view = meta_view(blocknum, data);
+	if (view != data)
+		memcpy(data, view, DISK_BLOCK_SIZE);
+}
 
-	//Traversing inode blocks
-	for(int i = 1; i <= block.super.ninodeblocks; i++) {
+/*
+Free blocks that committed metadata may still point to. With a journal
+they wait for the running transaction to commit, so a crash before then
+cannot leave the old owner pointing at blocks already reused.
+*/
+void blocks_release(int start, int length) {
+	if (!journaling()) {
+		blocks_free(start, length);
+		return;
+	}
+	pthread_mutex_lock(&journal_lock);
+	free_list_add(&journal.freed, start, length);
+	pthread_mutex_unlock(&journal_lock);
+}
 
-		//Read in inode block
-		disk_read(i, iblock.data);
+void free_list_release(struct free_list *fl) {
+	if (!journaling()) {
+		free_list_apply(fl);
+		return;
+	}
+	for (int i = 0; i < fl->n; i++) {
+		blocks_release(fl->runs[i].start, fl->runs[i].length);
+	}
+	free(fl->runs);
+	fl->runs = 0;
+	fl->n = 0;
+	fl->capacity = 0;
+}
 
-		//Traversing the inode block
-		for(int j=0; j< INODES_PER_BLOCK; j++){
+// Hand out the next block of a reserved run. Returns -1 when the disk is full.
+int run_take(struct run *run) {
+	if (!run_fill(run))
+		return -1;
+	run->left--;
+	return run->start++;
+}
 
-			if (!iblock.inode[j].isvalid)
-				continue;
+// Give back what is left of a reservation
+void run_release(struct run *run) {
+	if (run->left > 0)
+		blocks_free(run->start, run->left);
+	if (run->credit > 0)
+		blocks_unreserve(run->credit);
+	run->left = 0;
+	run->credit = 0;
+}
 
-			//Traversing inode direct pointers
-			for (int k = 0; k < POINTERS_PER_INODE; k++) {
-				if (iblock.inode[j].direct[k] != 0){
-					bitmap[iblock.inode[j].direct[k]] = 0;
-				}
-			}
+void cursor_init(struct bmap_cursor *c) {
+	for (int d = 0; d < BMAP_DEPTH; d++) {
+		c->blocknum[d] = 0;
+		c->dirty[d] = false;
+	}
+	c->extents = 0;
+	c->nextents = 0;
+	c->capacity = 0;
+}
 
-			//Traversing inode indirect pointers
-			if(iblock.inode[j].indirect !=0){
-				bitmap[iblock.inode[j].indirect] = 0;
-				disk_read(iblock.inode[j].indirect, indirect_block.data);
-				for (int k = 0; k < POINTERS_PER_BLOCK; k++) {
-					if (indirect_block.pointers[k] != 0)
-						bitmap[indirect_block.pointers[k]] = 0;
-				}
-			}
+// Forget what an initialized cursor holds
+void cursor_reset(struct bmap_cursor *c) {
+	free(c->extents);
+	cursor_init(c);
+}
+
+void extent_store(struct fs_inode *inode, struct bmap_cursor *c);
 
+// Write back the pointer blocks, or extents, changed through the cursor
+void cursor_flush(struct bmap_cursor *c, struct fs_inode *inode) {
+	if (c->extents)
+		extent_store(inode, c);
+	for (int d = 0; d < BMAP_DEPTH; d++) {
+		if (c->dirty[d]) {
+			meta_write(c->blocknum[d], c->level[d].data);
+			c->dirty[d] = false;
 		}
 	}
-	mounted = 1;
-	return 1;
 }
 
-int fs_create()
-{
-	union fs_block block;
-	union fs_block iblock;
-	// reading in superblock
-	disk_read(0, block.data);
-
-	//Check if FS is mounted
-	if (!mounted){
-		printf("Error: FS not mounted. Create failed\n");
-		return 0;
+// Make level d of the cursor hold pointer block blocknum; new blocks start zeroed
+int *cursor_load(struct bmap_cursor *c, int d, int blocknum, bool fresh) {
+	if (c->blocknum[d] != blocknum || fresh) {
+		if (c->dirty[d])
+			meta_write(c->blocknum[d], c->level[d].data);
+		if (fresh)
+			memset(c->level[d].data, 0, DISK_BLOCK_SIZE);
+		else
+			meta_read(blocknum, c->level[d].data);
+		c->blocknum[d] = blocknum;
+		c->dirty[d] = fresh;
 	}
+	return c->level[d].pointers;
+}
 
-	for(int i=1; i<=block.super.ninodeblocks; i++){
-		disk_read(i, iblock.data);
-		for (int j=0; j<INODES_PER_BLOCK; j++){
-			int inumber = get_inum(i, j);
-			if (inumber == 0)
-				continue;
-			if(iblock.inode[j].isvalid == 0){ //not valid means its free to use
-				iblock.inode[j].isvalid = 1;
-				iblock.inode[j].size = 0;
-				for (int k=0; k<POINTERS_PER_INODE; k++){
-					iblock.inode[j].direct[k] = 0; // setting entire array to 0
-					disk_write(i, iblock.data);
-				}
-				iblock.inode[j].indirect = 0;
+/*
+Claim the read-ahead state of a file, recycling the least recently used
+one. Returns null when the state, or every slot, is taken by another
+reader, who then goes without read-ahead. Given back with ra_put.
+*/
+struct readahead *ra_get(int inumber) {
+	struct readahead *ra = 0;
 
-				disk_read(i, iblock.data);
-				return inumber;
+	pthread_mutex_lock(&ra_lock);
+	for (int i = 0; i < RA_STREAMS; i++) {
+		if (ra_streams[i].inumber == inumber) {
+			ra = ra_streams[i].busy ? 0 : &ra_streams[i];
+			if (ra) {
+				ra->busy = true;
+				ra->last_use = ++ra_clock;
 			}
+			pthread_mutex_unlock(&ra_lock);
+			return ra;
 		}
+		if (!ra_streams[i].busy && (!ra || ra_streams[i].last_use < ra->last_use))
+			ra = &ra_streams[i];
+	}
+	if (ra) {
+		ra->busy = true;
+		ra->inumber = inumber;
+		ra->last_use = ++ra_clock;
 	}
+	pthread_mutex_unlock(&ra_lock);
+	if (!ra)
+		return 0;
 
-	return 0;
+	// The ring may still be filling for the file that had it before
+	io_wait(&ra->wait);
+	if (!ra->ring)
+		ra->ring = malloc(RA_MAX*DATA_BLOCK_SIZE);
+	ra->next_offset = 0;
+	ra->window = RA_MIN;
+	ra->start = 0;
+	ra->count = 0;
+	cursor_reset(&ra->cursor);
+	return ra;
 }
 
-int fs_delete(int inumber)
-{
-	// Make sure it has been mounted
-	if (!mounted) {
-	 	printf("Error: FS is not mounted. Delete failed\n");
-	 	return 0;
+void ra_put(struct readahead *ra) {
+	pthread_mutex_lock(&ra_lock);
+	ra->busy = false;
+	pthread_mutex_unlock(&ra_lock);
+}
+
+// Drop what is known about a file whose blocks or pointers changed. The
+// caller holds the inode lock exclusively; handles notice by the count.
+void ra_forget(int inumber) {
+	inode_changes[inumber]++;
+	pthread_mutex_lock(&ra_lock);
+	for (int i = 0; i < RA_STREAMS; i++) {
+		if (ra_streams[i].inumber == inumber && !ra_streams[i].busy) {
+			ra_streams[i].inumber = 0;
+			ra_streams[i].count = 0;
+			cursor_reset(&ra_streams[i].cursor);
+		}
 	}
+	pthread_mutex_unlock(&ra_lock);
+}
 
-	int iblocknum = get_iblock(inumber);
-	int real_inum = inumber;
-	inumber = get_inode_index(inumber); //inode_index
-	union fs_block block;
-	union fs_block iblock;
-	union fs_block indirect_block;
-	disk_read(0, block.data);
+/*
+Where file block index lives: which inode pointer leads to it, and the
+slot to follow in each level of pointer blocks below that. Returns the
+number of levels (0 for a direct block), or -1 past the largest file.
+*/
+int bmap_path(long index, int version, int *root, int path[BMAP_DEPTH]) {
+	const long ppb = POINTERS_PER_BLOCK;
 
-	if (!inumberValid(real_inum,block.super.ninodes)) {
+	if (index < POINTERS_PER_INODE) {
+		*root = index;
 		return 0;
 	}
+	index -= POINTERS_PER_INODE;
+	if (index < ppb) {
+		*root = POINTERS_PER_INODE;
+		path[0] = index;
+		return 1;
+	}
+	index -= ppb;
+	if (version >= 1 && index < ppb*ppb) {
+		*root = POINTERS_PER_INODE + 1;
+		path[0] = index / ppb;
+		path[1] = index % ppb;
+		return 2;
+	}
+	index -= ppb*ppb;
+	if (version >= 1 && index < ppb*ppb*ppb) {
+		*root = POINTERS_PER_INODE + 2;
+		path[0] = index / (ppb*ppb);
+		path[1] = (index / ppb) % ppb;
+		path[2] = index % ppb;
+		return 3;
+	}
+	return -1;
+}
+
+// The inode pointer numbered as in bmap_path
+int *inode_root(struct fs_inode *inode, int root) {
+	if (root < POINTERS_PER_INODE)
+		return &inode->direct[root];
+	if (root == POINTERS_PER_INODE)
+		return &inode->indirect;
+	if (root == POINTERS_PER_INODE + 1)
+		return &inode->dindirect;
+	return &inode->tindirect;
+}
 
-	disk_read(iblocknum, iblock.data);
-	int indirect_block_num = iblock.inode[inumber].indirect;
-	disk_read(indirect_block_num, indirect_block.data);
+/*
+Read-only view of a block. Direct views go around the cache, which is
+not thread safe, so they are only up to date once it has been flushed.
+*/
+const char *block_view(int blocknum, char *scratch, bool direct) {
+	const char *view;
 
-	if (iblock.inode[inumber].isvalid == 0){  // meaning it's already invalid
-		return 0;
+	if (!direct)
+		return meta_view(blocknum, scratch);
+	disk_viewv(&blocknum, 1, &view, &scratch);
+	return view;
+}
+
+/*
+Call fn on every extent of an extent inode, and, with meta set, on the
+blocks holding the extent list. Works on inodes read straight off the
+disk, so fs_debug can use it unmounted.
+*/
+void extent_foreach(const struct fs_inode *inode, bool direct, void (*fn)(void *arg, int start, int length, bool meta), void *arg) {
+	if (inode->extent_block == 0) {
+		for (int i = 0; i < inode->nextents; i++)
+			fn(arg, inode->extent[i].start, inode->extent[i].length, false);
+		return;
 	}
-	iblock.inode[inumber].isvalid = 0;
-	iblock.inode[inumber].size = 0;
 
-	// Free all inode direct pointers
-	for (int i = 0; i < POINTERS_PER_INODE; i++){
-		if (iblock.inode[inumber].direct[i] != 0){
-			bitmap[iblock.inode[inumber].direct[i]] = 1; // updating the bitmap free list
-			iblock.inode[inumber].direct[i] = 0;
-		}
+	union fs_block indexbuf, leafbuf;
+	const union fs_block *index = (const union fs_block *)block_view(inode->extent_block, indexbuf.data, direct);
+	int nleaves = (inode->nextents + EXTENTS_PER_BLOCK - 1)/EXTENTS_PER_BLOCK;
+
+	fn(arg, inode->extent_block, 1, true);
+	for (int l = 0; l < nleaves; l++) {
+		const union fs_block *leaf = (const union fs_block *)block_view(index->pointers[l], leafbuf.data, direct);
+		int n = inode->nextents - l*EXTENTS_PER_BLOCK;
+		if (n > EXTENTS_PER_BLOCK)
+			n = EXTENTS_PER_BLOCK;
+
+		fn(arg, index->pointers[l], 1, true);
+		for (int i = 0; i < n; i++)
+			fn(arg, leaf->extents[i].start, leaf->extents[i].length, false);
 	}
-	disk_write(iblocknum, iblock.data);
+}
 
-	// Free all inode indirect pointers
-	if (indirect_block_num != 0){
-		for (int i = 0; i < POINTERS_PER_BLOCK; i++){
-			bitmap[indirect_block.pointers[i]] = 1;
-			indirect_block.pointers[i] = 0;
-		}
-		bitmap[indirect_block_num] = 1;
-		iblock.inode[inumber].indirect = 0;
+// Read the extent list of an inode into the cursor
+void extent_load(struct fs_inode *inode, struct bmap_cursor *c) {
+	c->nextents = inode->nextents;
+	c->capacity = c->nextents + 16;
+	c->extents = malloc(c->capacity*sizeof(struct fs_extent));
+	c->first_dirty = c->nextents;
+
+	if (inode->extent_block == 0) {
+		memcpy(c->extents, inode->extent, c->nextents*sizeof(struct fs_extent));
+		return;
 	}
-	disk_write(indirect_block_num, indirect_block.data);
-	disk_write(iblocknum, iblock.data);
 
-	return 1;
+	int *index = cursor_load(c, 0, inode->extent_block, false);
+	for (int i = 0; i < c->nextents; i += EXTENTS_PER_BLOCK) {
+		union fs_block leafbuf;
+		const union fs_block *leaf = (const union fs_block *)meta_view(index[i/EXTENTS_PER_BLOCK], leafbuf.data);
+		int n = c->nextents - i < EXTENTS_PER_BLOCK ? c->nextents - i : EXTENTS_PER_BLOCK;
+		memcpy(c->extents + i, leaf->extents, n*sizeof(struct fs_extent));
+	}
 }
 
-int fs_getsize( int inumber )
-{
-	int iblocknum = get_iblock(inumber);
-	int inode_index = get_inode_index(inumber);
+// Put the extents changed through the cursor back in the inode or its extent blocks
+void extent_store(struct fs_inode *inode, struct bmap_cursor *c) {
+	if (c->first_dirty == c->nextents && inode->nextents == c->nextents)
+		return;
 
-	union fs_block block;
-	disk_read(0, block.data);
-	if (!inumberValid(inumber,block.super.ninodes)) {
-		return -1;
-	}
+	int old_leaves = (inode->nextents + EXTENTS_PER_BLOCK - 1)/EXTENTS_PER_BLOCK;
+	int nleaves = (c->nextents + EXTENTS_PER_BLOCK - 1)/EXTENTS_PER_BLOCK;
+	inode->nextents = c->nextents;
 
-	union fs_block iblock;
-	disk_read(iblocknum, iblock.data);
+	if (inode->extent_block == 0) {
+		memcpy(inode->extent, c->extents, c->nextents*sizeof(struct fs_extent));
+		c->first_dirty = c->nextents;
+		return;
+	}
 
-	// Fails for Invalid inodes
-	if (!iblock.inode[inode_index].isvalid || iblock.inode[inode_index].size < 0)
-		return -1;
+	// Only the extent blocks from the first change on are rewritten
+	int *index = c->level[0].pointers;
+	for (int l = c->first_dirty/EXTENTS_PER_BLOCK; l < nleaves; l++) {
+		union fs_block leaf;
+		int n = c->nextents - l*EXTENTS_PER_BLOCK;
+		if (n > EXTENTS_PER_BLOCK)
+			n = EXTENTS_PER_BLOCK;
+		memset(leaf.data, 0, DISK_BLOCK_SIZE);
+		memcpy(leaf.extents, c->extents + l*EXTENTS_PER_BLOCK, n*sizeof(struct fs_extent));
+		meta_write(index[l], leaf.data);
+	}
 
-	return iblock.inode[inode_index].size;
+	// Merged extents can leave the last extent block unused
+	for (int l = nleaves; l < old_leaves; l++) {
+		blocks_release(index[l], 1);
+		index[l] = 0;
+		c->dirty[0] = true;
+	}
+	c->first_dirty = c->nextents;
 }
 
-// Read from a certain inode
-int fs_read(int inumber, char *data, int length, int offset)
-{
-	union fs_block block; //super
-	disk_read(0, block.data);
+// Position of the last extent starting at or before file block index, -1 if none
+int extent_find(const struct bmap_cursor *c, long index) {
+	int lo = 0, hi = c->nextents;
 
-	if (!inumberValid(inumber,block.super.ninodes)) {
-		printf("inumber is invalid\n");
-		return 0;
+	while (lo < hi) {
+		int mid = (lo + hi)/2;
+		if (c->extents[mid].logical <= index)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	return lo - 1;
+}
 
-	int iblocknum = get_iblock(inumber);
-	inumber = get_inode_index(inumber);
-	// Clear data
-	strcpy(data, "");
-
-	union fs_block iblock; //inode block
-	union fs_block dblock; //data block
-	union fs_block indirect_block;
+/*
+bmap for extent file systems. A new block extends the extent before or
+after it when it happens to be contiguous with it on disk, which it
+usually is for appends, since runs are handed out in order. Otherwise
+a new extent is inserted, and the extent blocks it needs are taken from
+the run ahead of the data.
+*/
+int extent_bmap(struct fs_inode *inode, struct bmap_cursor *c, long index, struct run *run, bool *fresh) {
+	if (!c->extents)
+		extent_load(inode, c);
 
-	// Check if mounted
-	if (!mounted){
-		printf("Error: FS is not mounted. Read failed\n");
+	int pos = extent_find(c, index);
+	struct fs_extent *prev = pos >= 0 ? &c->extents[pos] : 0;
+	if (prev && index < prev->logical + prev->length)
+		return prev->start + (index - prev->logical);
+	if (!run)
 		return 0;
-	}
+	if (!run_fill(run))
+		return -1;
 
-	disk_read(iblocknum, iblock.data);
+	int blocknum = run->start;
+	struct fs_extent *next = pos + 1 < c->nextents ? &c->extents[pos+1] : 0;
+	bool join_prev = prev && prev->logical + prev->length == index && prev->start + prev->length == blocknum;
+	bool join_next = next && next->logical == index + 1 && next->start == blocknum + 1;
 
-	// Make sure inumber is valid
-	if (!iblock.inode[inumber].isvalid || iblock.inode[inumber].size <= offset)
-		return 0; // fails
-	if (iblock.inode[inumber].indirect > 0) {
-		disk_read(iblock.inode[inumber].indirect, indirect_block.data);
-	}
+	if (join_prev && join_next) {
+		prev->length += 1 + next->length;
+		memmove(next, next + 1, (c->nextents - pos - 2)*sizeof(struct fs_extent));
+		c->nextents--;
+	} else if (join_prev) {
+		prev->length++;
+	} else if (join_next) {
+		next->logical--;
+		next->start--;
+		next->length++;
+		pos++;
+	} else {
+		int nleaves = (c->nextents + EXTENTS_PER_BLOCK - 1)/EXTENTS_PER_BLOCK;
 
-	int direct_portion = DATA_BLOCK_SIZE*POINTERS_PER_INODE;
-	int current_direct_block;
-	int current_direct_index = offset/DATA_BLOCK_SIZE;
-	int current_indirect_block;
-	int current_indirect_index = (offset-DATA_BLOCK_SIZE*POINTERS_PER_INODE)/DATA_BLOCK_SIZE;
-	int bytes_read = 0;
-	int bytes_read_rn = 0;
-	int amount_to_read = iblock.inode[inumber].size - offset;
-
-	while (amount_to_read > 0) {
-		bytes_read_rn = 0;
-
-		//Data container exceeds length (16384)
-		if (strlen(data) >= length) {
-			return bytes_read;
-		}
-
-		// direct block section
-		if (offset + bytes_read < direct_portion) {
-			current_direct_block = iblock.inode[inumber].direct[current_direct_index];
-			printf("Current direct block is %d\n", current_direct_block);
-			if (current_direct_block > 0) {
-				disk_read(current_direct_block, dblock.data);
-
-				// Smaller segments
-				if (amount_to_read <= DATA_BLOCK_SIZE) {
-					bytes_read += strlen(dblock.data);
-					bytes_read_rn = strlen(dblock.data);
-					strncat(data, dblock.data, bytes_read_rn);
-				} else { //when amount to read exceeds block size
-					// read what we can fit in - 4kb
-					bytes_read += DATA_BLOCK_SIZE;
-					bytes_read_rn = DATA_BLOCK_SIZE;
-					strncat(data, dblock.data, DATA_BLOCK_SIZE);
-				}
-				amount_to_read = amount_to_read - bytes_read_rn;
+		if (inode->extent_block == 0 && c->nextents == INLINE_EXTENTS) {
+			// Spill out of the inode into an index and a first extent block
+			int indexnum = run_take(run);
+			int leafnum = run_take(run);
+			if (leafnum < 0) {
+				if (indexnum > 0)
+					blocks_free(indexnum, 1);
+				return -1;
 			}
-			current_direct_index++;
-			current_indirect_index++;
+			inode->extent_block = indexnum;
+			cursor_load(c, 0, indexnum, true)[0] = leafnum;
+			c->first_dirty = 0;
+		} else if (inode->extent_block != 0 && c->nextents == nleaves*EXTENTS_PER_BLOCK) {
+			if (nleaves == POINTERS_PER_BLOCK)
+				return -1;
+			int leafnum = run_take(run);
+			if (leafnum < 0)
+				return -1;
+			c->level[0].pointers[nleaves] = leafnum;
+			c->dirty[0] = true;
 		}
+		if (!run_fill(run))
+			return -1;
+		blocknum = run->start;
 
-		// indirect block section
-		else {
-			// Reach end of inode or no indirect
-			if (!iblock.inode[inumber].indirect || current_indirect_index >= POINTERS_PER_BLOCK){
-				return bytes_read;
-			}
-
-			current_indirect_block = indirect_block.pointers[current_indirect_index];
-
-			if (current_indirect_block > 0) {
-				disk_read(current_indirect_block, dblock.data);
-				// Smaller segments
-				if (amount_to_read <= DATA_BLOCK_SIZE) {
-					bytes_read += amount_to_read;
-					bytes_read_rn = amount_to_read;
-					strncat(data, dblock.data, bytes_read_rn);
-				} else { //when amount to read exceeds block size
-					// read what we can fit in - 4kb
-					bytes_read += DATA_BLOCK_SIZE;
-					bytes_read_rn = DATA_BLOCK_SIZE;
-					strncat(data, dblock.data, DATA_BLOCK_SIZE);
-				}
-				amount_to_read = amount_to_read - bytes_read_rn;
-			}
-			current_indirect_index++;
+		if (c->nextents == c->capacity) {
+			c->capacity *= 2;
+			c->extents = realloc(c->extents, c->capacity*sizeof(struct fs_extent));
 		}
+		pos++;
+		memmove(&c->extents[pos+1], &c->extents[pos], (c->nextents - pos)*sizeof(struct fs_extent));
+		c->extents[pos].logical = index;
+		c->extents[pos].start = blocknum;
+		c->extents[pos].length = 1;
+		c->nextents++;
 	}
+	if (pos < c->first_dirty)
+		c->first_dirty = pos;
 
-	return bytes_read;
+	run_take(run);
+	if (fresh)
+		*fresh = true;
+	return blocknum;
 }
 
-int fs_write(int inumber, const char *data, int length, int offset)
-{
-	union fs_block block; //super
-	disk_read(0, block.data);
+/*
+Block number holding file block index, or 0 for a hole. Given a run to
+allocate from, missing pointer blocks and the data block are created on
+the way, and *fresh tells whether the data block is new. Returns -1 past
+the largest file or when the disk is full. The caller marks the inode
+dirty and flushes the cursor.
+*/
+bool pointer_own(struct bmap_cursor *c, int d, int *pointer, struct run *run);
 
-	if (!inumberValid(inumber,block.super.ninodes)) {
-		printf("inumber is invalid\n");
-		return 0;
-	}
+int bmap(struct fs_inode *inode, struct bmap_cursor *c, long index, struct run *run, bool *fresh) {
+	int root, path[BMAP_DEPTH];
+	int depth = bmap_path(index, super.version, &root, path);
 
-	int iblocknum = get_iblock(inumber);
-	inumber = get_inode_index(inumber); //inode_index
+	if (fresh)
+		*fresh = false;
+	if (depth < 0)
+		return -1;
+	if (super.flags & FS_EXTENTS)
+		return extent_bmap(inode, c, index, run, fresh);
 
-	//Check if mounted
-	if(!mounted){
-		printf("Error: FS is not mounted. Write failed\n");
+	int *pointer = inode_root(inode, root);
+	for (int d = 0; ; d++) {
+		bool created = false;
+		if (*pointer == 0) {
+			if (!run)
+				return 0;
+			int blocknum = run_take(run);
+			if (blocknum < 0)
+				return -1;
+			*pointer = blocknum;
+			if (d > 0)
+				c->dirty[d-1] = true;
+			created = true;
+		}
+		if (d == depth) {
+			if (fresh)
+				*fresh = created;
+			return *pointer;
+		}
+		// Pointer blocks on the way to a write are copied if clones share them
+		if (run && !created && !pointer_own(c, d, pointer, run))
+			return -1;
+		pointer = &cursor_load(c, d, *pointer, created)[path[d]];
+	}
+}
+
+/*
+Point file block index at blocknum, on file systems with block pointers,
+placing missing pointer blocks from run. Returns the block it pointed at
+before, or -1 when the disk is full.
+*/
+int bmap_set(struct fs_inode *inode, struct bmap_cursor *c, long index, struct run *run, int blocknum) {
+	int root, path[BMAP_DEPTH];
+	int depth = bmap_path(index, super.version, &root, path);
+	if (depth < 0)
+		return -1;
+
+	int *pointer = inode_root(inode, root);
+	for (int d = 0; d < depth; d++) {
+		bool created = false;
+		if (*pointer == 0) {
+			int newnum = run_take(run);
+			if (newnum < 0)
+				return -1;
+			*pointer = newnum;
+			if (d > 0)
+				c->dirty[d-1] = true;
+			created = true;
+		}
+		if (!created && !pointer_own(c, d, pointer, run))
+			return -1;
+		pointer = &cursor_load(c, d, *pointer, created)[path[d]];
+	}
+
+	int old = *pointer;
+	if (old != blocknum) {
+		*pointer = blocknum;
+		if (depth > 0)
+			c->dirty[depth-1] = true;
+	}
+	return old;
+}
+
+// Block number of file block index, 0 for a hole or past the last pointer
+int ra_blocknum(struct readahead *ra, struct fs_inode *inode, long index) {
+	int blocknum = bmap(inode, &ra->cursor, index, 0, 0);
+	return blocknum > 0 ? blocknum : 0;
+}
+
+struct fs_inode *inode_get(int inumber) {
+	char *iblock = inode_table[get_iblock(inumber)-1].data;
+	return (struct fs_inode *)(iblock + get_inode_index(inumber)*super.inode_size);
+}
+
+void inode_mark_dirty(int inumber) {
+	if (!__atomic_exchange_n(&inode_dirty[get_iblock(inumber)-1], 1, __ATOMIC_RELAXED))
+		__atomic_add_fetch(&inode_ndirty, 1, __ATOMIC_RELAXED);
+}
+
+pthread_rwlock_t *inode_lock(int inumber) {
+	return &inode_locks[inumber % INODE_LOCKS];
+}
+
+// Lock two inodes exclusively, in stripe order so that pairs never deadlock
+void inode_lock_pair(int a, int b) {
+	pthread_rwlock_t *la = inode_lock(a), *lb = inode_lock(b);
+	if (la > lb) {
+		pthread_rwlock_t *t = la;
+		la = lb;
+		lb = t;
+	}
+	pthread_rwlock_wrlock(la);
+	if (lb != la)
+		pthread_rwlock_wrlock(lb);
+}
+
+void inode_unlock_pair(int a, int b) {
+	pthread_rwlock_unlock(inode_lock(a));
+	if (inode_lock(b) != inode_lock(a))
+		pthread_rwlock_unlock(inode_lock(b));
+}
+
+// Directories are only read and written through the dir_ functions
+bool inode_is_dir(const struct fs_inode *inode) {
+	return (super.flags & FS_DIRECTORIES) && inode->type == INODE_DIR;
+}
+
+// Named inodes, and the root, are deleted through their names only
+bool inode_named(const struct fs_inode *inode) {
+	return inode_is_dir(inode) || ((super.flags & FS_DIRECTORIES) && inode->parent != 0);
+}
+
+/*
+Small files on FS_INLINE file systems keep their data in the rest of the
+inode record, which is in memory while mounted, until a write takes them
+past it. Bytes past the size stay zero, as in a block.
+*/
+bool inode_is_inline(const struct fs_inode *inode) {
+	return (super.flags & FS_INLINE) && inode->inlined;
+}
+
+char *inode_inline(struct fs_inode *inode) {
+	return (char *)(inode + 1);
+}
+
+bool inode_is_compressed(const struct fs_inode *inode) {
+	return (super.flags & FS_COMPRESS) && inode->compressed;
+}
+
+int inline_capacity() {
+	return super.inode_size - (int)sizeof(struct fs_inode);
+}
+
+void inode_clear(struct fs_inode *inode) {
+	memset(inode, 0, super.inode_size);
+}
+
+// The delayed allocation buffer of a file, or null if it has none
+struct delalloc *delalloc_find(int inumber) {
+	struct delalloc *da = 0;
+
+	pthread_mutex_lock(&delalloc_lock);
+	for (int i = 0; i < DELALLOC_BUFFERS && !da; i++) {
+		if (delalloc_buffers[i].inumber == inumber)
+			da = &delalloc_buffers[i];
+	}
+	pthread_mutex_unlock(&delalloc_lock);
+	return da;
+}
+
+// Give a buffer up, with whatever it still has set aside
+void delalloc_put(struct delalloc *da) {
+	if (da->reserved > 0)
+		blocks_unreserve(da->reserved);
+	pthread_mutex_lock(&delalloc_lock);
+	da->inumber = 0;
+	da->count = 0;
+	da->reserved = 0;
+	pthread_mutex_unlock(&delalloc_lock);
+}
+
+/*
+Place the buffered blocks of a file and write them out, then free the
+buffer. The caller holds the inode lock exclusively and passes the
+cursor it has been mapping the file with, since this changes the map.
+*/
+void delalloc_flush(struct delalloc *da, struct fs_inode *inode, struct bmap_cursor *c) {
+	int *blocknums = malloc(da->count*sizeof(int));
+	char **buffers = malloc(da->count*sizeof(char *));
+	struct run run = {0, 0, 0, da->reserved};
+	int n;
+
+	// The run takes over what was set aside
+	da->reserved = 0;
+	ra_forget(da->inumber);
+
+	for (n = 0; n < da->count; n++) {
+		int left = da->count - n;
+		run.want = left + BMAP_DEPTH;
+		blocknums[n] = bmap(inode, c, da->first + n, &run, 0);
+		if (blocknums[n] < 0) {
+			printf("The disk is full.\n");
+			break;
+		}
+		buffers[n] = da->data + n*DATA_BLOCK_SIZE;
+	}
+	for (int done = 0; done < n; done += IO_BATCH) {
+		int count = n - done < IO_BATCH ? n - done : IO_BATCH;
+		cache_writev(blocknums + done, count, buffers + done);
+	}
+	run_release(&run);
+	inode_mark_dirty(da->inumber);
+
+	free(blocknums);
+	free(buffers);
+	delalloc_put(da);
+}
+
+/*
+The buffered copy of file block index, added to the file's buffer when
+it can take it, or null if the block has to be placed right away. A
+buffer that cannot grow to take the block is flushed first.
+*/
+char *delalloc_block(int inumber, struct fs_inode *inode, struct bmap_cursor *c, long index) {
+	struct delalloc *da = delalloc_find(inumber);
+
+	if (da && index >= da->first && index < da->first + da->count)
+		return da->data + (index - da->first)*DATA_BLOCK_SIZE;
+	if (da && index == da->first + da->count && da->count < DELALLOC_MAX && blocks_reserve(1)) {
+		da->reserved++;
+	} else {
+		if (da)
+			delalloc_flush(da, inode, c);
+		da = 0;
+
+		// A new buffer sets aside room for pointer blocks on top
+		pthread_mutex_lock(&delalloc_lock);
+		for (int i = 0; i < DELALLOC_BUFFERS && !da; i++) {
+			if (delalloc_buffers[i].inumber == 0) {
+				da = &delalloc_buffers[i];
+				da->inumber = inumber;
+			}
+		}
+		pthread_mutex_unlock(&delalloc_lock);
+		if (!da)
+			return 0;
+		if (!blocks_reserve(1 + 2*BMAP_DEPTH)) {
+			delalloc_put(da);
+			return 0;
+		}
+		if (!da->data)
+			da->data = malloc(DELALLOC_MAX*DATA_BLOCK_SIZE);
+		da->first = index;
+		da->reserved = 1 + 2*BMAP_DEPTH;
+	}
+
+	// New blocks start out zeroed
+	char *block = da->data + da->count*DATA_BLOCK_SIZE;
+	memset(block, 0, DATA_BLOCK_SIZE);
+	da->count++;
+	return block;
+}
+
+// Drop a file's buffered blocks, for a file being deleted
+void delalloc_discard(int inumber) {
+	struct delalloc *da = delalloc_find(inumber);
+	if (da)
+		delalloc_put(da);
+}
+
+// Flush every buffer, for a commit or unmount, with no operations in progress
+void delalloc_flush_all() {
+	for (int i = 0; i < DELALLOC_BUFFERS; i++) {
+		int inumber = delalloc_buffers[i].inumber;
+		if (inumber == 0)
+			continue;
+
+		struct bmap_cursor cursor;
+		struct fs_inode *inode = inode_get(inumber);
+
+		cursor_init(&cursor);
+		pthread_rwlock_wrlock(inode_lock(inumber));
+		delalloc_flush(&delalloc_buffers[i], inode, &cursor);
+		cursor_flush(&cursor, inode);
+		pthread_rwlock_unlock(inode_lock(inumber));
+		cursor_reset(&cursor);
+	}
+}
+
+// The open handle numbered fd, or null
+struct handle *handle_get(int fd) {
+	if (fd < 0 || fd >= OPEN_FILES || handles[fd].inumber == 0)
+		return 0;
+	return &handles[fd];
+}
+
+/*
+Whether the file of a handle is still there, with the handle's cached
+map and prefetched blocks dropped if it has changed since they were
+read. The caller holds the inode lock.
+*/
+bool handle_check(struct handle *h) {
+	if (inode_deletes[h->inumber] != h->deletes)
+		return false;
+	if (inode_changes[h->inumber] != h->changes) {
+		io_wait(&h->ra.wait);
+		cursor_reset(&h->ra.cursor);
+		h->ra.count = 0;
+		h->changes = inode_changes[h->inumber];
+	}
+	return true;
+}
+
+// Free a handle, once its prefetches have landed
+void handle_release(struct handle *h) {
+	io_wait(&h->ra.wait);
+	free(h->ra.ring);
+	cursor_reset(&h->ra.cursor);
+	pthread_mutex_lock(&handle_lock);
+	memset(h, 0, sizeof(*h));
+	pthread_mutex_unlock(&handle_lock);
+}
+
+void inodemap_build() {
+	bitmap_init(&inodemap, super.ninodes, 1);
+	bitmap_clear(&inodemap, 0);	// inumber 0 is never handed out
+	for (int inumber = 1; inumber < super.ninodes; inumber++) {
+		if (inode_get(inumber)->isvalid)
+			bitmap_clear(&inodemap, inumber);
+	}
+}
+
+// Claim up to n free inodes, lowest first. Returns how many were found.
+int inodemap_claim(int *inumbers, int n) {
+	int found = 0;
+
+	pthread_mutex_lock(&create_lock);
+	while (found < n) {
+		int inumber = bitmap_find_set(&inodemap);
+		if (inumber <= 0)
+			break;
+		bitmap_clear(&inodemap, inumber);
+		inumbers[found++] = inumber;
+	}
+	pthread_mutex_unlock(&create_lock);
+	return found;
+}
+
+// Return inodes to the free map, keeping fs_create on the lowest free one
+void inodemap_release(const int *inumbers, int n) {
+	pthread_mutex_lock(&create_lock);
+	for (int i = 0; i < n; i++) {
+		bitmap_set(&inodemap, inumbers[i]);
+		if (inumbers[i] / BITS_PER_WORD < inodemap.hint)
+			inodemap.hint = inumbers[i] / BITS_PER_WORD;
+	}
+	pthread_mutex_unlock(&create_lock);
+}
+
+// Write back every inode block changed since the last flush
+void inode_flush() {
+	for (int i = 0; i < super.ninodeblocks; i++) {
+		if (inode_dirty[i]) {
+			meta_write(i+1, inode_table[i].data);
+			inode_dirty[i] = 0;
+		}
+	}
+	inode_ndirty = 0;
+}
+
+// Hash of a data block's contents, for finding duplicates; matches are compared in full
+uint64_t block_hash(const char *data) {
+	uint64_t lanes[4] = {1, 2, 3, 4};
+	uint64_t hash = 0;
+
+	// Four independent lanes, so the multiplies overlap
+	for (int i = 0; i < DATA_BLOCK_SIZE; i += 4*sizeof(uint64_t)) {
+		for (int k = 0; k < 4; k++) {
+			uint64_t word;
+			memcpy(&word, data + i + k*sizeof(uint64_t), sizeof(uint64_t));
+			lanes[k] = (lanes[k] ^ word) * 0x9e3779b97f4a7c15ull;
+			lanes[k] ^= lanes[k] >> 29;
+		}
+	}
+	for (int k = 0; k < 4; k++) {
+		hash = (hash ^ lanes[k]) * 0xff51afd7ed558ccdull;
+		hash ^= hash >> 33;
+	}
+	return hash ? hash : 1;
+}
+
+struct fs_dedup *dedup_entry(int blocknum) {
+	return &dedup_table[blocknum / DEDUP_PER_BLOCK].dedup[blocknum % DEDUP_PER_BLOCK];
+}
+
+void dedup_mark_dirty(int blocknum) {
+	if (!__atomic_exchange_n(&dedup_dirty[blocknum / DEDUP_PER_BLOCK], 1, __ATOMIC_RELAXED))
+		__atomic_add_fetch(&dedup_ndirty, 1, __ATOMIC_RELAXED);
+}
+
+int dedup_home(uint64_t hash) {
+	return hash & (dedup_nslots - 1);
+}
+
+// The index functions are called with dedup_lock held, or before mounting completes
+void dedup_index_add(int blocknum) {
+	int s = dedup_home(dedup_entry(blocknum)->hash);
+	while (dedup_index[s] != 0)
+		s = (s + 1) & (dedup_nslots - 1);
+	dedup_index[s] = blocknum;
+}
+
+// Take a block out, moving later blocks of its probe sequence back into the gap
+void dedup_index_remove(int blocknum) {
+	int mask = dedup_nslots - 1;
+	int hole = dedup_home(dedup_entry(blocknum)->hash);
+	while (dedup_index[hole] != blocknum)
+		hole = (hole + 1) & mask;
+
+	for (int s = (hole + 1) & mask; dedup_index[s] != 0; s = (s + 1) & mask) {
+		int home = dedup_home(dedup_entry(dedup_index[s])->hash);
+		if (((s - home) & mask) >= ((s - hole) & mask)) {
+			dedup_index[hole] = dedup_index[s];
+			hole = s;
+		}
+	}
+	dedup_index[hole] = 0;
+}
+
+// First block with this hash, 0 if there is none
+int dedup_find(uint64_t hash) {
+	for (int s = dedup_home(hash); dedup_index[s] != 0; s = (s + 1) & (dedup_nslots - 1)) {
+		if (dedup_entry(dedup_index[s])->hash == hash)
+			return dedup_index[s];
+	}
+	return 0;
+}
+
+// Enter a block just written for one slot of a file
+void dedup_add(int blocknum, uint64_t hash) {
+	pthread_mutex_lock(&dedup_lock);
+	struct fs_dedup *e = dedup_entry(blocknum);
+	e->hash = hash;
+	e->refs = 1;
+	dedup_index_add(blocknum);
+	dedup_mark_dirty(blocknum);
+	pthread_mutex_unlock(&dedup_lock);
+}
+
+// Leave a block's entry empty, as for one with no users
+void dedup_clear(int blocknum) {
+	struct fs_dedup *e = dedup_entry(blocknum);
+	if (e->refs > 0 && e->hash != 0)
+		dedup_index_remove(blocknum);
+	e->hash = 0;
+	e->refs = 0;
+	dedup_mark_dirty(blocknum);
+}
+
+// Whether a block is in the table with this hash
+bool dedup_holds(int blocknum, uint64_t hash) {
+	pthread_mutex_lock(&dedup_lock);
+	struct fs_dedup *e = dedup_entry(blocknum);
+	bool holds = e->refs > 0 && e->hash == hash;
+	pthread_mutex_unlock(&dedup_lock);
+	return holds;
+}
+
+/*
+Give up one slot's use of a data block. Returns true when that was the
+last, leaving the caller to free the block. Blocks written on other file
+systems, or not through the table, count as having a single user.
+*/
+bool dedup_put(int blocknum) {
+	if (!(super.flags & FS_DEDUP))
+		return true;
+
+	pthread_mutex_lock(&dedup_lock);
+	struct fs_dedup *e = dedup_entry(blocknum);
+	bool last = e->refs <= 1;
+	if (last) {
+		if (e->refs == 1)
+			dedup_clear(blocknum);
+	} else {
+		e->refs--;
+		dedup_mark_dirty(blocknum);
+		if (journaling())
+			bitmap_set(&dedup_unshared, blocknum);
+	}
+	pthread_mutex_unlock(&dedup_lock);
+	return last;
+}
+
+// Take one more slot's use of a block, for a clone
+void dedup_get(int blocknum) {
+	pthread_mutex_lock(&dedup_lock);
+	struct fs_dedup *e = dedup_entry(blocknum);
+	e->refs = (e->refs > 0 ? e->refs : 1) + 1;
+	dedup_mark_dirty(blocknum);
+	pthread_mutex_unlock(&dedup_lock);
+}
+
+/*
+Take a block out of the table for its one user to write over in place.
+Fails for a block other slots use, or used as of the last commit, which
+must be copied instead.
+*/
+bool dedup_claim(int blocknum) {
+	if (!(super.flags & FS_DEDUP))
+		return true;
+
+	pthread_mutex_lock(&dedup_lock);
+	struct fs_dedup *e = dedup_entry(blocknum);
+	bool mine = e->refs <= 1 && !(journaling() && bitmap_test(&dedup_unshared, blocknum));
+	if (mine && e->refs == 1)
+		dedup_clear(blocknum);
+	pthread_mutex_unlock(&dedup_lock);
+	return mine;
+}
+
+/*
+Whether a block holds the same bytes as data. A write of the block still
+in flight is compared instead, and waited for, so that it is on disk
+before anything reads the block through another file.
+*/
+bool block_matches(int blocknum, const char *data) {
+	char block[DATA_BLOCK_SIZE];
+
+	pthread_mutex_lock(&io_lock);
+	for (int i = 0; i < WRITE_BEHIND; i++) {
+		struct wb_slot *slot = &wb_slots[i];
+		if (slot->wait.pending > 0 && slot->blocknum == blocknum) {
+			bool same = memcmp(slot->data, data, DATA_BLOCK_SIZE) == 0;
+			pthread_mutex_unlock(&io_lock);
+			if (same)
+				io_wait(&slot->wait);
+			return same;
+		}
+	}
+	pthread_mutex_unlock(&io_lock);
+
+	struct io_wait wait = {0};
+	io_submit_read(blocknum, block, &wait);
+	io_wait(&wait);
+	return memcmp(block, data, DATA_BLOCK_SIZE) == 0;
+}
+
+/*
+Find a block already holding data, with the hash given, and take it for
+one more slot. The bytes are compared outside dedup_lock, so the entry is
+checked again after, in case the block lost its last user meanwhile.
+Returns 0 when there is none.
+*/
+int dedup_share(const char *data, uint64_t hash) {
+	pthread_mutex_lock(&dedup_lock);
+	int blocknum = dedup_find(hash);
+	pthread_mutex_unlock(&dedup_lock);
+	if (blocknum == 0 || !block_matches(blocknum, data))
+		return 0;
+
+	pthread_mutex_lock(&dedup_lock);
+	struct fs_dedup *e = dedup_entry(blocknum);
+	bool shared = e->refs > 0 && e->hash == hash;
+	if (shared) {
+		e->refs++;
+		dedup_mark_dirty(blocknum);
+	}
+	pthread_mutex_unlock(&dedup_lock);
+	return shared ? blocknum : 0;
+}
+
+/*
+Make the pointer block *pointer, at level d of the cursor, this file's
+alone before it is changed. One that clones share is copied to a block
+from run, the copy taking a use of every block it points to, and the
+original giving up this file's. Pointer blocks are journaled, so unlike
+data blocks one need not be copied for having been shared at the last
+commit. Returns false when the disk is full.
+*/
+bool pointer_own(struct bmap_cursor *c, int d, int *pointer, struct run *run) {
+	if (!(super.flags & FS_DEDUP))
+		return true;
+
+	pthread_mutex_lock(&dedup_lock);
+	bool shared = dedup_entry(*pointer)->refs > 1;
+	pthread_mutex_unlock(&dedup_lock);
+	if (!shared)
+		return true;
+
+	int copy = run_take(run);
+	if (copy < 0)
+		return false;
+	const int *pointers = cursor_load(c, d, *pointer, false);
+
+	// The other users may have let it go meanwhile, leaving it to this file
+	pthread_mutex_lock(&dedup_lock);
+	struct fs_dedup *e = dedup_entry(*pointer);
+	shared = e->refs > 1;
+	if (shared) {
+		for (int k = 0; k < POINTERS_PER_BLOCK; k++) {
+			if (pointers[k] == 0)
+				continue;
+			struct fs_dedup *child = dedup_entry(pointers[k]);
+			child->refs = (child->refs > 0 ? child->refs : 1) + 1;
+			dedup_mark_dirty(pointers[k]);
+		}
+		e->refs--;
+		dedup_mark_dirty(*pointer);
+	}
+	pthread_mutex_unlock(&dedup_lock);
+	if (!shared) {
+		blocks_free(copy, 1);
+		return true;
+	}
+
+	c->blocknum[d] = copy;
+	c->dirty[d] = true;
+	*pointer = copy;
+	if (d > 0)
+		c->dirty[d-1] = true;
+	return true;
+}
+
+// Write back every table block changed since the last flush
+void dedup_flush() {
+	if (!(super.flags & FS_DEDUP))
+		return;
+	for (int i = 0; i < super.ndedupblocks; i++) {
+		if (dedup_dirty[i]) {
+			meta_write(super.dedup_start + i, dedup_table[i].data);
+			dedup_dirty[i] = 0;
+		}
+	}
+	dedup_ndirty = 0;
+	if (dedup_unshared.nset > 0)
+		bitmap_clear_run(&dedup_unshared, 0, super.nblocks);
+}
+
+// Checksum of a transaction's logged blocks and where they belong
+unsigned journal_checksum(unsigned sum, const char *data, int length) {
+	for (int i = 0; i < length; i++) {
+		sum = (sum ^ (unsigned char)data[i]) * 16777619u;
+	}
+	return sum;
+}
+
+// Blocks of log needed for n logged blocks: descriptors, the blocks and a commit
+int journal_log_size(int n) {
+	return (n + JOURNAL_SLOTS - 1)/JOURNAL_SLOTS + n + 1;
+}
+
+void journal_header_write(int sequence) {
+	union fs_block block;
+
+	memset(block.data, 0, DISK_BLOCK_SIZE);
+	block.journal.magic = JOURNAL_HEADER;
+	block.journal.sequence = sequence;
+	write_blocks(super.journal_start, 1, block.data);
+}
+
+// Write logged blocks to where they belong, in disk order
+void journal_apply(const int *blocknums, char * const *data, int n) {
+	for (int done = 0; done < n; done += IO_BATCH) {
+		int count = n - done < IO_BATCH ? n - done : IO_BATCH;
+		cache_writev(blocknums + done, count, data + done);
+	}
+	disk_sync();
+}
+
+int entry_compare(const void *a, const void *b) {
+	const struct journal_entry *x = *(struct journal_entry * const *)a;
+	const struct journal_entry *y = *(struct journal_entry * const *)b;
+	return (x->blocknum > y->blocknum) - (x->blocknum < y->blocknum);
+}
+
+/*
+Commit the running transaction, with no handles open. Buffered new
+blocks are placed first, so that the commit covers them. The data blocks
+the metadata points at go to disk before anything else, then the log of the changed
+metadata, in one sequential write ending with the commit block. Once
+that is on disk the blocks are written in place and the header moves on
+past the transaction, after which its freed blocks can be reused. A
+transaction too big for the journal, which takes a single operation the
+size of the disk, is written in place without the log.
+*/
+void journal_commit() {
+	delalloc_flush_all();
+	inode_flush();
+	dedup_flush();
+	if (!journaling())
+		return;
+	if (journal.n == 0 && __atomic_load_n(&journal.freed.n, __ATOMIC_RELAXED) == 0)
+		return;
+
+	io_drain();
+	cache_flush();
+
+	int n = journal.n;
+	struct journal_entry **sorted = malloc(n*sizeof(struct journal_entry *));
+	int *blocknums = malloc(n*sizeof(int));
+	char **data = malloc(n*sizeof(char *));
+	for (int i = 0; i < n; i++) {
+		sorted[i] = &journal.entries[i];
+	}
+	qsort(sorted, n, sizeof(struct journal_entry *), entry_compare);
+	for (int i = 0; i < n; i++) {
+		blocknums[i] = sorted[i]->blocknum;
+		data[i] = sorted[i]->block.data;
+	}
+
+	int logsize = journal_log_size(n);
+	bool logged = n > 0 && logsize <= super.njournalblocks - 1;
+	if (logged) {
+		union fs_block *log = malloc(logsize*sizeof(union fs_block));
+		unsigned sum = 2166136261u;
+		int pos = 0;
+
+		for (int i = 0; i < n; i += JOURNAL_SLOTS) {
+			int count = n - i < JOURNAL_SLOTS ? n - i : JOURNAL_SLOTS;
+			struct fs_journal_block *desc = &log[pos++].journal;
+
+			memset(desc, 0, DISK_BLOCK_SIZE);
+			desc->magic = JOURNAL_DESCRIPTOR;
+			desc->sequence = journal.sequence;
+			desc->nblocks = count;
+			memcpy(desc->blocknums, blocknums + i, count*sizeof(int));
+			for (int j = 0; j < count; j++) {
+				memcpy(log[pos++].data, data[i+j], DISK_BLOCK_SIZE);
+				sum = journal_checksum(sum, (const char *)&blocknums[i+j], sizeof(int));
+				sum = journal_checksum(sum, data[i+j], DISK_BLOCK_SIZE);
+			}
+		}
+
+		struct fs_journal_block *commit = &log[pos].journal;
+		memset(commit, 0, DISK_BLOCK_SIZE);
+		commit->magic = JOURNAL_COMMIT;
+		commit->sequence = journal.sequence;
+		commit->nblocks = n;
+		commit->checksum = sum;
+
+		// The checksum lets replay tell a torn log, so one flush covers it all
+		write_blocks(super.journal_start + 1, logsize, log[0].data);
+		disk_sync();
+		free(log);
+	}
+
+	journal_apply(blocknums, data, n);
+	if (logged) {
+		journal.sequence++;
+		journal_header_write(journal.sequence);
+		disk_sync();
+	}
+
+	// Blocks freed by operations finishing meanwhile wait for the next commit
+	pthread_mutex_lock(&journal_lock);
+	struct free_list freed = journal.freed;
+	journal.freed.runs = 0;
+	journal.freed.n = 0;
+	journal.freed.capacity = 0;
+	journal.n = 0;
+	for (int b = 0; b < JOURNAL_BUCKETS; b++) {
+		journal.buckets[b] = -1;
+	}
+	pthread_mutex_unlock(&journal_lock);
+	free_list_apply(&freed);
+	free(sorted);
+	free(blocknums);
+	free(data);
+}
+
+/*
+Redo the last transaction if it was committed but may not have been
+written in place. A log that does not end in a matching commit block was
+cut short by a crash and is ignored. Returns 0 if the journal is damaged.
+*/
+int journal_replay() {
+	union fs_block block;
+	int end = super.journal_start + super.njournalblocks;
+
+	read_blocks(super.journal_start, 1, block.data);
+	if (block.journal.magic != JOURNAL_HEADER)
+		return 0;
+	journal.sequence = block.journal.sequence;
+
+	int n = 0;
+	int *blocknums = malloc(super.njournalblocks*sizeof(int));
+	char **data = malloc(super.njournalblocks*sizeof(char *));
+	union fs_block *logged = malloc(super.njournalblocks*sizeof(union fs_block));
+	unsigned sum = 2166136261u;
+	bool committed = false;
+
+	for (int pos = super.journal_start + 1; pos < end; ) {
+		read_blocks(pos++, 1, block.data);
+		if (block.journal.sequence != journal.sequence)
+			break;
+		if (block.journal.magic == JOURNAL_COMMIT) {
+			committed = block.journal.nblocks == n && block.journal.checksum == sum;
+			break;
+		}
+		if (block.journal.magic != JOURNAL_DESCRIPTOR || block.journal.nblocks <= 0
+		    || block.journal.nblocks > JOURNAL_SLOTS || pos + block.journal.nblocks >= end)
+			break;
+
+		int count = block.journal.nblocks;
+		read_blocks(pos, count, logged[n].data);
+		for (int i = 0; i < count; i++) {
+			blocknums[n+i] = block.journal.blocknums[i];
+			data[n+i] = logged[n+i].data;
+			sum = journal_checksum(sum, (const char *)&blocknums[n+i], sizeof(int));
+			sum = journal_checksum(sum, data[n+i], DISK_BLOCK_SIZE);
+		}
+		pos += count;
+		n += count;
+	}
+
+	for (int i = 0; committed && i < n; i++) {
+		if (blocknums[i] <= 0 || blocknums[i] >= super.nblocks)
+			committed = false;
+	}
+	if (committed) {
+		journal_apply(blocknums, data, n);
+		journal.sequence++;
+		journal_header_write(journal.sequence);
+		disk_sync();
+	}
+
+	free(blocknums);
+	free(data);
+	free(logged);
+	return 1;
+}
+
+void journal_init() {
+	journal.n = 0;
+	for (int b = 0; b < JOURNAL_BUCKETS; b++) {
+		journal.buckets[b] = -1;
+	}
+	journal.handles = 0;
+	journal.committing = false;
+}
+
+// Space the journal may fill before journal_end commits it
+int journal_threshold() {
+	return (super.njournalblocks - 1)/2;
+}
+
+// Start an operation that changes metadata; it waits out a commit in progress
+void journal_begin() {
+	if (!journaling())
+		return;
+	pthread_mutex_lock(&journal_lock);
+	while (journal.committing)
+		pthread_cond_wait(&journal_idle, &journal_lock);
+	journal.handles++;
+	pthread_mutex_unlock(&journal_lock);
+}
+
+/*
+Finish an operation, committing the running transaction if force is set.
+Commits are grouped: the operation that takes the running transaction
+past half the journal commits it, once every other operation in it has
+finished, and the rest wait until that is done. A forced finish that
+finds a commit under way waits for it instead, as it covers everything.
+*/
+void journal_finish(bool force) {
+	if (!journaling())
+		return;
+	pthread_mutex_lock(&journal_lock);
+	journal.handles--;
+	int size = journal.n + __atomic_load_n(&inode_ndirty, __ATOMIC_RELAXED)
+		   + __atomic_load_n(&dedup_ndirty, __ATOMIC_RELAXED);
+	if (journal.committing || (!force && journal_log_size(size) < journal_threshold())) {
+		if (journal.handles == 0)
+			pthread_cond_broadcast(&journal_idle);
+		while (force && journal.committing)
+			pthread_cond_wait(&journal_idle, &journal_lock);
+		pthread_mutex_unlock(&journal_lock);
+		return;
+	}
+
+	journal.committing = true;
+	while (journal.handles > 0)
+		pthread_cond_wait(&journal_idle, &journal_lock);
+	pthread_mutex_unlock(&journal_lock);
+
+	journal_commit();
+
+	pthread_mutex_lock(&journal_lock);
+	journal.committing = false;
+	pthread_cond_broadcast(&journal_idle);
+	pthread_mutex_unlock(&journal_lock);
+}
+
+void journal_end() {
+	journal_finish(false);
+}
+
+/*
+Put everything done so far on disk: the running transaction, and data
+written in place outside it. The caller holds fs_lock, shared if the
+file system is journaled and exclusively if not, as then nothing else
+keeps operations off the metadata being written.
+*/
+void do_sync() {
+	if (journaling()) {
+		journal_begin();
+		journal_finish(true);
+	} else {
+		journal_commit();
+	}
+	io_drain();
+	cache_flush();
+	disk_sync();
+}
+
+/*
+Sync every JOURNAL_AGE seconds while a journaled file system is mounted,
+so that a crash loses at most that much work even when the journal never
+fills. A round is skipped while a call has the file system to itself;
+unmount is one, and stops the flusher.
+*/
+void *flusher_main(void *arg) {
+	pthread_mutex_lock(&flusher_lock);
+	while (flusher_running) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += JOURNAL_AGE;
+		pthread_cond_timedwait(&flusher_wake, &flusher_lock, &until);
+		if (!flusher_running)
+			break;
+		pthread_mutex_unlock(&flusher_lock);
+		if (pthread_rwlock_tryrdlock(&fs_lock) == 0) {
+			if (mounted)
+				do_sync();
+			pthread_rwlock_unlock(&fs_lock);
+		}
+		pthread_mutex_lock(&flusher_lock);
+	}
+	pthread_mutex_unlock(&flusher_lock);
+	return 0;
+}
+
+void flusher_start() {
+	flusher_running = true;
+	if (pthread_create(&flusher, 0, flusher_main, 0) != 0)
+		flusher_running = false;
+}
+
+void flusher_stop() {
+	if (!flusher_running)
+		return;
+	pthread_mutex_lock(&flusher_lock);
+	flusher_running = false;
+	pthread_cond_signal(&flusher_wake);
+	pthread_mutex_unlock(&flusher_lock);
+	pthread_join(flusher, 0);
+}
+
+void print_extent(void *arg, int start, int length, bool meta) {
+	if (!meta)
+		printf("%d-%d ", start, start + length - 1);
+}
+
+void do_debug()
+{
+
+	union fs_block block;
+	union fs_block indirect_block;
+	const union fs_block *sb, *ib, *indirect;
+
+	// Make pending metadata changes visible on disk first
+	if (mounted)
+		journal_commit();
+
+	// Look at the super block in place when the disk is memory mapped
+	sb = (const union fs_block *)cache_view(0, block.data);
+
+	//int magic = sb->super.magic;
+	int validSuperblock = check_magic(sb->super.magic);
+
+	printf("superblock:\n");
+	if(validSuperblock)
+		printf("    magic number is valid\n");
+	else{
+		printf("    magic number is not valid\n");
+		return;
+	}
+	printf("    %d blocks\n",sb->super.nblocks);
+	printf("    %d inode blocks\n",sb->super.ninodeblocks);
+	printf("    %d inodes\n",sb->super.ninodes);
+	if (sb->super.version >= 1 && sb->super.nbitmapblocks > 0) {
+		printf("    %d bitmap blocks\n",sb->super.nbitmapblocks);
+		printf("    %s\n",sb->super.clean ? "clean" : "not cleanly unmounted");
+	}
+	if (sb->super.version >= 2 && sb->super.njournalblocks > 0)
+		printf("    %d journal blocks\n",sb->super.njournalblocks);
+	if (mounted)
+		printf("    %d free blocks\n", bitmap_count(&freemap));
+	int ninodeblocks = sb->super.ninodeblocks;
+	int version = sb->super.version;
+	int flags = version >= 1 ? sb->super.flags : 0;
+	if (flags & FS_EXTENTS)
+		printf("    extent based inodes\n");
+	if (flags & FS_DIRECTORIES)
+		printf("    root directory: inode %d\n", sb->super.root);
+	int inode_size = super_inode_size(&sb->super);
+	int ipb = DISK_BLOCK_SIZE / inode_size;
+	if (flags & FS_INLINE)
+		printf("    %d byte inodes, small files inline\n", inode_size);
+	if (flags & FS_COMPRESS)
+		printf("    compressed files allowed\n");
+	if (flags & FS_DEDUP) {
+		printf("    %d dedup table blocks\n", sb->super.ndedupblocks);
+		// The table is in memory, and current, only while mounted
+		int shared = 0, saved = 0;
+		for (int b = 0; mounted && b < super.nblocks; b++) {
+			int refs = dedup_entry(b)->refs;
+			shared += refs > 1;
+			saved += refs > 1 ? refs - 1 : 0;
+		}
+		if (mounted)
+			printf("    %d shared blocks, saving %d\n", shared, saved);
+	}
+
+	// Traversing inode blocks
+	for(int i=1; i<=ninodeblocks; i++){ //added equal
+		// Read in inode block
+		ib = (const union fs_block *)cache_view(i, block.data);
+
+		// Traverse inodes
+		for(int j = 0; j<ipb; j++) {
+			const struct fs_inode *inode = (const struct fs_inode *)(ib->data + j*inode_size);
+			// Check if inode is valid
+			if(inode->isvalid) {
+				int inumber = get_inum(i, j, ipb);
+				long size = inode_getsize(inode, version);
+				printf("inode %d:\n", inumber);
+				printf("    size: %ld bytes\n", size);
+				if ((flags & FS_DIRECTORIES) && inode->type == INODE_DIR)
+					printf("    directory\n");
+				if ((flags & FS_COMPRESS) && inode->compressed)
+					printf("    compressed: %d data blocks stored\n", inode->stored);
+				if ((flags & FS_INLINE) && inode->inlined) {
+					printf("    inline data\n");
+					continue;
+				}
+
+				if (flags & FS_EXTENTS) {
+					if (inode->extent_block != 0)
+						printf("    extent block: %d\n", inode->extent_block);
+					printf("    extents: ");
+					extent_foreach(inode, false, print_extent, 0);
+					printf("\n");
+					continue;
+				}
+
+				// Traverse direct pointers
+				if(size > 0){
+					printf("    direct blocks: ");
+					print_valid_blocks(inode->direct, POINTERS_PER_INODE);
+				}
+
+				// Traverse indirect pointers
+				if(inode->indirect != 0){
+					printf("    indirect block: %d\n", inode->indirect);
+					printf("    indirect data blocks: ");
+					indirect = (const union fs_block *)cache_view(inode->indirect, indirect_block.data);
+					print_valid_blocks(indirect->pointers, POINTERS_PER_BLOCK);
+				}
+
+				// Only the top blocks of the deeper trees, their leaves can number millions
+				if(version >= 1 && inode->dindirect != 0)
+					printf("    double indirect block: %d\n", inode->dindirect);
+				if(version >= 1 && inode->tindirect != 0)
+					printf("    triple indirect block: %d\n", inode->tindirect);
+			}
+		}
+
+	}
+}
+
+int do_format(int flags) {
+	union fs_block block;
+
+	//Check if FS already mounted
+	if ( mounted ){
+		printf("FS is already mounted, format failed\n");
+	 	return 0;
+	}
+	// Sharing a block in the middle of an extent would have to split it
+	if ((flags & FS_DEDUP) && (flags & FS_EXTENTS)) {
+		printf("Error: Dedup does not work with extents. Format failed\n");
+		return 0;
+	}
+
+	//Create superblock, prepare for mount
+	int ninodeblocks = ceil(.1 * (double)disk_size());
+	memset(block.data, 0, DISK_BLOCK_SIZE);
+	block.super.magic = FS_MAGIC;
+	block.super.nblocks = disk_size();
+	block.super.ninodeblocks = ninodeblocks;
+	int inode_size = (flags & FS_INLINE) ? INODE_SIZE_INLINE : INODE_SIZE;
+	block.super.ninodes = DISK_BLOCK_SIZE / inode_size * ninodeblocks;
+	block.super.version = FS_VERSION;
+	block.super.inode_size = inode_size;
+	block.super.flags = flags;
+	block.super.bitmap_start = ninodeblocks + 1;
+	block.super.nbitmapblocks = (disk_size() + BITS_PER_BLOCK - 1)/BITS_PER_BLOCK;
+	block.super.clean = 1;
+
+	// A journal of 1/64 of the disk, which small disks go without
+	int njournalblocks = disk_size()/64;
+	if (njournalblocks < JOURNAL_MIN)
+		njournalblocks = JOURNAL_MIN;
+	if (njournalblocks > JOURNAL_MAX)
+		njournalblocks = JOURNAL_MAX;
+	if (njournalblocks > disk_size()/8)
+		njournalblocks = 0;
+	block.super.journal_start = block.super.bitmap_start + block.super.nbitmapblocks;
+	block.super.njournalblocks = njournalblocks;
+	int journal_start = block.super.journal_start;
+
+	// The dedup table, an entry per block, follows the journal
+	if (flags & FS_DEDUP) {
+		block.super.dedup_start = journal_start + njournalblocks;
+		block.super.ndedupblocks = (disk_size() + DEDUP_PER_BLOCK - 1)/DEDUP_PER_BLOCK;
+	}
+	int metadata_end = journal_start + njournalblocks + block.super.ndedupblocks;
+	int dedup_start = block.super.dedup_start;
+	int ndedupblocks = block.super.ndedupblocks;
+
+	// Write changes to disk
+	cache_write(0, block.data);
+
+	// Everything after the metadata starts out free
+	struct bitmap map;
+	char *words = calloc(block.super.nbitmapblocks, DISK_BLOCK_SIZE);
+	bitmap_init(&map, disk_size(), 1);
+	bitmap_clear_run(&map, 0, metadata_end);
+	bitmap_store(&map, words);
+	write_blocks(block.super.bitmap_start, block.super.nbitmapblocks, words);
+	bitmap_destroy(&map);
+	free(words);
+
+	//Clear the inode table, a batch of zeroed blocks at a time
+	char *zeros = calloc(IO_BATCH, DISK_BLOCK_SIZE);
+	for(int i=1; i<=ninodeblocks; i+=IO_BATCH){
+		int n = ninodeblocks - i + 1 < IO_BATCH ? ninodeblocks - i + 1 : IO_BATCH;
+		write_blocks(i, n, zeros);
+	}
+	for (int i = 0; i < ndedupblocks; i += IO_BATCH) {
+		int n = ndedupblocks - i < IO_BATCH ? ndedupblocks - i : IO_BATCH;
+		write_blocks(dedup_start + i, n, zeros);
+	}
+
+	// An empty journal: the header, and no transaction after it
+	if (njournalblocks > 0) {
+		write_blocks(journal_start + 1, 1, zeros);
+		memset(block.data, 0, DISK_BLOCK_SIZE);
+		block.journal.magic = JOURNAL_HEADER;
+		block.journal.sequence = 1;
+		write_blocks(journal_start, 1, block.data);
+	}
+	free(zeros);
+
+	return 1;
+}
+
+/*
+Pointer blocks found while rebuilding the free map, waiting to be read a
+batch at a time. Queue level holds blocks whose entries point to data at
+level 0, and to pointer blocks of the level below otherwise.
+*/
+struct scan_queue {
+	int blocknums[IO_BATCH];
+	int n;
+	char *bufs[IO_BATCH];
+};
+
+/*
+One share of the rebuild: the inodes [first, last) are walked, and the
+blocks they use are cleared in map. Shares run on threads of their own,
+each with a private map, and read around the cache. On FS_DEDUP file
+systems the slots pointing at each block are counted in refs, which all
+shares add to, with SCAN_POINTER set for pointer blocks. Those may be
+shared by clones, and only the first share to find one reads it.
+*/
+struct scan {
+	int first;
+	int last;
+	struct bitmap *map;
+	int *refs;
+	struct bitmap own;
+	struct scan_queue queues[BMAP_DEPTH];
+	union fs_block *batch;
+	pthread_t thread;
+};
+
+void scan_push(struct scan *sc, int level, int blocknum);
+
+void scan_data(struct scan *sc, int blocknum) {
+	bitmap_clear(sc->map, blocknum);
+	if (sc->refs)
+		__atomic_add_fetch(&sc->refs[blocknum], 1, __ATOMIC_RELAXED);
+}
+
+// Look at a batch of pointer blocks and mark what they point to as used
+void scan_flush(struct scan *sc, int level) {
+	struct scan_queue *q = &sc->queues[level];
+	const char *views[IO_BATCH];
+
+	disk_viewv(q->blocknums, q->n, views, q->bufs);
+	for (int i = 0; i < q->n; i++) {
+		const union fs_block *pointers = (const union fs_block *)views[i];
+		for (int k = 0; k < POINTERS_PER_BLOCK; k++) {
+			if (pointers->pointers[k] == 0)
+				continue;
+			if (level == 0)
+				scan_data(sc, pointers->pointers[k]);
+			else
+				scan_push(sc, level - 1, pointers->pointers[k]);
+		}
+	}
+	q->n = 0;
+}
+
+void scan_extent(void *arg, int start, int length, bool meta) {
+	struct scan *sc = arg;
+	bitmap_clear_run(sc->map, start, length);
+}
+
+void scan_push(struct scan *sc, int level, int blocknum) {
+	struct scan_queue *q = &sc->queues[level];
+
+	bitmap_clear(sc->map, blocknum);
+	if (sc->refs) {
+		int seen = __atomic_fetch_add(&sc->refs[blocknum], 1, __ATOMIC_RELAXED);
+		__atomic_fetch_or(&sc->refs[blocknum], SCAN_POINTER, __ATOMIC_RELAXED);
+		if (seen & ~SCAN_POINTER)
+			return;
+	}
+	q->blocknums[q->n++] = blocknum;
+	if (q->n == IO_BATCH)
+		scan_flush(sc, level);
+}
+
+void *scan_inodes(void *arg) {
+	struct scan *sc = arg;
+
+	// Pointer blocks are collected and read a batch at a time per level
+	sc->batch = malloc(BMAP_DEPTH*IO_BATCH*sizeof(union fs_block));
+	for (int d = 0; d < BMAP_DEPTH; d++) {
+		sc->queues[d].n = 0;
+		for (int i = 0; i < IO_BATCH; i++) {
+			sc->queues[d].bufs[i] = sc->batch[d*IO_BATCH + i].data;
+		}
+	}
+
+	//Traversing inodes
+	for(int inumber = sc->first; inumber < sc->last; inumber++) {
+		struct fs_inode *inode = inode_get(inumber);
+
+		if (!inode->isvalid)
+			continue;
+
+		// Extent inodes cost one bitmap update per extent
+		if (super.flags & FS_EXTENTS) {
+			extent_foreach(inode, true, scan_extent, sc);
+			continue;
+		}
+
+		//Traversing inode direct pointers
+		for (int k = 0; k < POINTERS_PER_INODE; k++) {
+			if (inode->direct[k] != 0){
+				scan_data(sc, inode->direct[k]);
+			}
+		}
+
+		//Queue the inode's pointer blocks
+		if(inode->indirect !=0)
+			scan_push(sc, 0, inode->indirect);
+		if (super.version >= 1 && inode->dindirect != 0)
+			scan_push(sc, 1, inode->dindirect);
+		if (super.version >= 1 && inode->tindirect != 0)
+			scan_push(sc, 2, inode->tindirect);
+	}
+	// Deepest first, since those batches feed the levels below
+	for (int d = BMAP_DEPTH - 1; d >= 0; d--) {
+		scan_flush(sc, d);
+	}
+	free(sc->batch);
+	return 0;
+}
+
+// Write the in-memory superblock back to disk right away
+void super_write() {
+	union fs_block block;
+
+	memset(block.data, 0, DISK_BLOCK_SIZE);
+	block.super = super;
+	cache_write(0, block.data);
+	cache_flush();
+}
+
+void freemap_read() {
+	char *words = malloc(super.nbitmapblocks*DISK_BLOCK_SIZE);
+	read_blocks(super.bitmap_start, super.nbitmapblocks, words);
+	bitmap_load(&freemap, words);
+	free(words);
+}
+
+void freemap_write() {
+	char *words = calloc(super.nbitmapblocks, DISK_BLOCK_SIZE);
+	bitmap_store(&freemap, words);
+	write_blocks(super.bitmap_start, super.nbitmapblocks, words);
+	free(words);
+}
+
+/*
+Find the used blocks by walking every valid inode, for a map not saved
+cleanly. Large inode tables are split between threads, each building
+its own map, and the maps are merged at the end. Shared data blocks are
+found once per slot pointing at them, counted in refs if it is given.
+*/
+void freemap_rebuild(int *refs) {
+	bitmap_clear(&freemap, 0);	// Super block is never free
+	//Setting inode blocks to not free
+	for (int j=1; j<=super.ninodeblocks; j++){
+		bitmap_clear(&freemap, j);
+	}
+	bitmap_clear_run(&freemap, super.bitmap_start, super.nbitmapblocks);
+	bitmap_clear_run(&freemap, super.journal_start, super.njournalblocks);
+	bitmap_clear_run(&freemap, super.dedup_start, super.ndedupblocks);
+
+	// Pointer blocks are read around the cache, so it must hold nothing newer
+	cache_flush();
+
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > SCAN_THREADS)
+		nthreads = SCAN_THREADS;
+	if (nthreads > super.ninodeblocks/SCAN_MIN_IBLOCKS)
+		nthreads = super.ninodeblocks/SCAN_MIN_IBLOCKS;
+
+	if (nthreads <= 1) {
+		struct scan sc = {.first = 1, .last = super.ninodes, .map = &freemap, .refs = refs};
+		scan_inodes(&sc);
+		return;
+	}
+
+	// Shares start on inode block boundaries; inumber 0 is never used
+	struct scan *shares = calloc(nthreads, sizeof(struct scan));
+	for (int t = 0; t < nthreads; t++) {
+		struct scan *sc = &shares[t];
+		sc->first = (long)super.ninodeblocks*t/nthreads*inodes_per_block;
+		sc->last = (long)super.ninodeblocks*(t+1)/nthreads*inodes_per_block;
+		if (sc->first == 0)
+			sc->first = 1;
+		bitmap_init(&sc->own, super.nblocks, 1);
+		sc->map = &sc->own;
+		sc->refs = refs;
+		if (pthread_create(&sc->thread, 0, scan_inodes, sc) != 0) {
+			sc->map = &freemap;
+			scan_inodes(sc);
+		}
+	}
+	for (int t = 0; t < nthreads; t++) {
+		struct scan *sc = &shares[t];
+		if (sc->map == &sc->own) {
+			pthread_join(sc->thread, 0);
+			bitmap_and(&freemap, &sc->own);
+		}
+		bitmap_destroy(&sc->own);
+	}
+	free(shares);
+}
+
+void dedup_load() {
+	dedup_table = malloc(super.ndedupblocks*sizeof(union fs_block));
+	dedup_dirty = calloc(super.ndedupblocks, 1);
+	dedup_ndirty = 0;
+	read_blocks(super.dedup_start, super.ndedupblocks, dedup_table[0].data);
+	bitmap_init(&dedup_unshared, super.nblocks, 0);
+}
+
+/*
+Correct the table from the slots a rebuild found pointing at each block.
+The counts are off only after a crash without a journal, when the table
+on disk can be as old as the last unmount. Pointer blocks never have a
+hash, since they must not be shared with a file's data.
+*/
+void dedup_recount(const int *refs) {
+	for (int b = 0; b < super.nblocks; b++) {
+		struct fs_dedup *e = dedup_entry(b);
+		int count = refs[b] & ~SCAN_POINTER;
+		bool pointer = (refs[b] & SCAN_POINTER) != 0;
+		if ((e->refs == count || (e->refs == 0 && count == 1)) && !(pointer && e->hash != 0))
+			continue;
+		e->refs = count > 1 || e->refs > 0 ? count : 0;
+		if (e->refs == 0 || pointer)
+			e->hash = 0;
+		dedup_mark_dirty(b);
+	}
+}
+
+void dedup_index_build() {
+	dedup_nslots = 1;
+	while (dedup_nslots < 2*super.nblocks)
+		dedup_nslots *= 2;
+	dedup_index = calloc(dedup_nslots, sizeof(int));
+	for (int b = 0; b < super.nblocks; b++) {
+		if (dedup_entry(b)->refs > 0 && dedup_entry(b)->hash != 0)
+			dedup_index_add(b);
+	}
+}
+
+int do_mount()
+{
+	//Check if mounted already
+	if (mounted){
+		printf("Error: FS is already mounted. Mount failed\n");
+		return 0;
+	}
+
+	// Read in the super block
+	union fs_block block;
+	const union fs_block *sb = (const union fs_block *)cache_view(0, block.data);
+
+	//Check if file system present
+	if (!check_magic(sb->super.magic)){
+		printf("Error: Filesystem is not present on disk\n");
+		return 0;
+	}
+	super = sb->super;
+	if (super.version > FS_VERSION) {
+		printf("Error: Filesystem version %d is not supported\n", super.version);
+		return 0;
+	}
+	if (super.version < 1)
+		super.flags = 0;
+	if (super.flags & ~(FS_EXTENTS | FS_DIRECTORIES | FS_INLINE | FS_COMPRESS | FS_DEDUP)) {
+		printf("Error: Filesystem uses unknown features %#x\n", super.flags);
+		return 0;
+	}
+	super.inode_size = super_inode_size(&sb->super);
+	inodes_per_block = DISK_BLOCK_SIZE / super.inode_size;
+	if (super.version < 2) {
+		super.journal_start = 0;
+		super.njournalblocks = 0;
+	}
+	if (!(super.flags & FS_DEDUP)) {
+		super.dedup_start = 0;
+		super.ndedupblocks = 0;
+	}
+
+	// Finish writing whatever a crash left committed in the journal
+	journal_init();
+	if (journaling() && !journal_replay()) {
+		printf("Error: Journal is damaged. Mount failed\n");
+		return 0;
+	}
+
+	//Load the inode table, it stays in memory while mounted
+	for (int i = 0; i < INODE_LOCKS; i++) {
+		pthread_rwlock_init(&inode_locks[i], 0);
+	}
+	inode_table = malloc(super.ninodeblocks*sizeof(union fs_block));
+	inode_dirty = calloc(super.ninodeblocks, 1);
+	inode_changes = calloc(super.ninodes, sizeof(int));
+	inode_deletes = calloc(super.ninodes, sizeof(int));
+	read_blocks(1, super.ninodeblocks, inode_table[0].data);
+	if (super.flags & FS_DEDUP)
+		dedup_load();
+
+	// Trust the map on disk only if the last mount ended cleanly, and
+	// mark it untrusted until this one does. A rebuild also recounts
+	// the users of shared blocks, before they are indexed.
+	bitmap_init(&freemap, super.nblocks, 1);
+	if (super.nbitmapblocks > 0 && super.clean) {
+		freemap_read();
+	} else {
+		int *refs = (super.flags & FS_DEDUP) ? calloc(super.nblocks, sizeof(int)) : 0;
+		freemap_rebuild(refs);
+		if (refs)
+			dedup_recount(refs);
+		free(refs);
+	}
+	if (super.flags & FS_DEDUP)
+		dedup_index_build();
+	inodemap_build();
+	if (super.nbitmapblocks > 0) {
+		super.clean = 0;
+		super_write();
+	}
+
+	mounted = 1;
+	if (journaling())
+		flusher_start();
+	return 1;
+}
+
+int do_unmount()
+{
+	if (!mounted)
+		return 0;
+
+	flusher_stop();
+	io_drain();
+	for (int i = 0; i < OPEN_FILES; i++) {
+		if (handles[i].inumber != 0)
+			handle_release(&handles[i]);
+	}
+	journal_commit();
+	if (super.nbitmapblocks > 0) {
+		// The map and everything it describes reach the disk before the flag
+		freemap_write();
+		cache_flush();
+		super.clean = 1;
+		super_write();
+	}
+	for (int i = 0; i < RA_STREAMS; i++) {
+		free(ra_streams[i].ring);
+		cursor_reset(&ra_streams[i].cursor);
+	}
+	memset(ra_streams, 0, sizeof(ra_streams));
+	for (int i = 0; i < DELALLOC_BUFFERS; i++) {
+		free(delalloc_buffers[i].data);
+	}
+	memset(delalloc_buffers, 0, sizeof(delalloc_buffers));
+	free(journal.entries);
+	journal.entries = 0;
+	journal.capacity = 0;
+	free(inode_table);
+	free(inode_dirty);
+	free(inode_changes);
+	free(inode_deletes);
+	free(dedup_table);
+	free(dedup_dirty);
+	free(dedup_index);
+	bitmap_destroy(&freemap);
+	bitmap_destroy(&inodemap);
+	bitmap_destroy(&dedup_unshared);
+	inode_table = 0;
+	inode_dirty = 0;
+	inode_changes = 0;
+	inode_deletes = 0;
+	dedup_table = 0;
+	dedup_dirty = 0;
+	dedup_index = 0;
+	for (int i = 0; i < INODE_LOCKS; i++) {
+		pthread_rwlock_destroy(&inode_locks[i]);
+	}
+	mounted = 0;
+	return 1;
+}
+
+void fs_debug()
+{
+	pthread_rwlock_wrlock(&fs_lock);
+	do_debug();
+	pthread_rwlock_unlock(&fs_lock);
+}
+
+int fs_format() {
+	return fs_format_with(0);
+}
+
+int make_root();
+
+int fs_format_with(int flags) {
+	pthread_rwlock_wrlock(&fs_lock);
+	int result = do_format(flags);
+	if (result && (flags & FS_DIRECTORIES))
+		result = make_root();
+	pthread_rwlock_unlock(&fs_lock);
+	return result;
+}
+
+int fs_mount()
+{
+	pthread_rwlock_wrlock(&fs_lock);
+	int result = do_mount();
+	pthread_rwlock_unlock(&fs_lock);
+	return result;
+}
+
+int fs_unmount()
+{
+	pthread_rwlock_wrlock(&fs_lock);
+	int result = do_unmount();
+	pthread_rwlock_unlock(&fs_lock);
+	return result;
+}
+
+int fs_sync()
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	if (mounted && !journaling()) {
+		pthread_rwlock_unlock(&fs_lock);
+		pthread_rwlock_wrlock(&fs_lock);
+	}
+
+	int result = mounted;
+	if (!mounted)
+		printf("Error: FS is not mounted. Sync failed\n");
+	else
+		do_sync();
+
+	pthread_rwlock_unlock(&fs_lock);
+	return result;
+}
+
+// Give claimed inodes a fresh, empty state
+void inode_init(const int *inumbers, int n) {
+	for (int i = 0; i < n; i++) {
+		journal_begin();
+		pthread_rwlock_wrlock(inode_lock(inumbers[i]));
+		struct fs_inode *inode = inode_get(inumbers[i]);
+		inode_clear(inode); // size and every pointer to 0
+		inode->isvalid = 1;
+		// Older inodes end before this field, it would land in the next one
+		if (super.flags & FS_INLINE)
+			inode->inlined = 1;
+		inode_mark_dirty(inumbers[i]);
+		pthread_rwlock_unlock(inode_lock(inumbers[i]));
+		journal_end();
+	}
+}
+
+int fs_create()
+{
+	int inumber = 0;
+
+	pthread_rwlock_rdlock(&fs_lock);
+
+	//Check if FS is mounted
+	if (!mounted){
+		printf("Error: FS not mounted. Create failed\n");
+	} else if (inodemap_claim(&inumber, 1)) {
+		inode_init(&inumber, 1);
+	}
+
+	pthread_rwlock_unlock(&fs_lock);
+	return inumber;
+}
+
+/*
+Create up to n inodes, storing their numbers in inumbers. Returns how many
+were made, fewer than n when the inode table fills up. Inodes sharing a
+block only dirty it once, so each inode block is written once per flush.
+*/
+int fs_create_many( int n, int *inumbers )
+{
+	int found = 0;
+
+	pthread_rwlock_rdlock(&fs_lock);
+
+	if (!mounted){
+		printf("Error: FS not mounted. Create failed\n");
+	} else if (n > 0) {
+		found = inodemap_claim(inumbers, n);
+		inode_init(inumbers, found);
+	}
+
+	pthread_rwlock_unlock(&fs_lock);
+	return found;
+}
+
+unsigned dir_hash(const char *name) {
+	unsigned hash = 2166136261u;
+	for (; *name; name++)
+		hash = (hash ^ (unsigned char)*name) * 16777619u;
+	return hash;
+}
+
+void dir_attach(struct dir *d, int inumber) {
+	d->inumber = inumber;
+	d->inode = inode_get(inumber);
+	cursor_init(&d->cursor);
+}
+
+// Read directory block index; holes read as zeros
+void dir_read(struct dir *d, long index, union fs_block *block) {
+	int blocknum = bmap(d->inode, &d->cursor, index, 0, 0);
+	if (blocknum > 0)
+		meta_read(blocknum, block->data);
+	else
+		memset(block->data, 0, DISK_BLOCK_SIZE);
+}
+
+// Write directory block index, placing it if need be. Fails only when the disk is full.
+bool dir_write(struct dir *d, long index, const union fs_block *block) {
+	struct run run = {0, 0, 1 + BMAP_DEPTH, 0};
+	int blocknum = bmap(d->inode, &d->cursor, index, &run, 0);
+	run_release(&run);
+	if (blocknum < 0)
+		return false;
+
+	meta_write(blocknum, block->data);
+	if ((index + 1)*DATA_BLOCK_SIZE > inode_getsize(d->inode, super.version))
+		inode_setsize(d->inode, (index + 1)*DATA_BLOCK_SIZE);
+	inode_mark_dirty(d->inumber);
+	return true;
+}
+
+/*
+Start work on a directory, reading its header. The caller holds its
+inode lock, and ends with dir_close whether or not the inode turned out
+to be a directory.
+*/
+bool dir_open(struct dir *d, int inumber) {
+	dir_attach(d, inumber);
+	if (!d->inode->isvalid || !inode_is_dir(d->inode))
+		return false;
+	dir_read(d, 0, &d->header);
+	return d->header.dir.magic == DIR_MAGIC;
+}
+
+void dir_close(struct dir *d) {
+	cursor_flush(&d->cursor, d->inode);
+	cursor_reset(&d->cursor);
+}
+
+// Lay out an empty directory: a header, a table of one slot, and that slot's bucket
+bool dir_format(struct dir *d) {
+	union fs_block zeros;
+
+	memset(zeros.data, 0, DISK_BLOCK_SIZE);
+	memset(d->header.data, 0, DISK_BLOCK_SIZE);
+	d->header.dir.magic = DIR_MAGIC;
+	d->header.dir.nbuckets = 1;
+	return dir_write(d, 0, &d->header) && dir_write(d, 1, &zeros) && dir_write(d, DIR_FIRST_BUCKET, &zeros);
+}
+
+// The bucket a hash leads to, looked up in the table
+int dir_bucket_of(struct dir *d, unsigned hash) {
+	union fs_block table;
+	int slot = hash & ((1u << d->header.dir.depth) - 1);
+
+	dir_read(d, 1 + slot/POINTERS_PER_BLOCK, &table);
+	return table.pointers[slot % POINTERS_PER_BLOCK];
+}
+
+// Where name is in its bucket, read into bucket, or -1 if it is not there
+int dir_find(struct dir *d, const char *name, int *index, union fs_block *bucket) {
+	*index = dir_bucket_of(d, dir_hash(name));
+	dir_read(d, DIR_FIRST_BUCKET + *index, bucket);
+	for (int i = 0; i < bucket->bucket.count; i++) {
+		if (!strcmp(bucket->bucket.entries[i].name, name))
+			return i;
+	}
+	return -1;
+}
+
+/*
+Split full bucket number index, held in bucket, on the next bit of the
+hash. New blocks are written before anything that points at them, so a
+full disk leaves the directory as it was. Returns false then, or when
+the table is as deep as it goes.
+*/
+bool dir_split(struct dir *d, int index, union fs_block *bucket) {
+	struct fs_dirheader *h = &d->header.dir;
+	struct fs_dirbucket *b = &bucket->bucket;
+	union fs_block table, split;
+
+	// A bucket using every bit of the table needs it doubled first,
+	// the new upper half a copy of the lower
+	int depth = h->depth;
+	if (b->depth == depth) {
+		int n = 1 << depth;
+		if (depth == DIR_DEPTH_MAX)
+			return false;
+		if (n < POINTERS_PER_BLOCK) {
+			dir_read(d, 1, &table);
+			memcpy(table.pointers + n, table.pointers, n*sizeof(int));
+			dir_write(d, 1, &table);
+		} else {
+			for (int k = 0; k < n/POINTERS_PER_BLOCK; k++) {
+				dir_read(d, 1 + k, &table);
+				if (!dir_write(d, 1 + n/POINTERS_PER_BLOCK + k, &table))
+					return false;
+			}
+		}
+		depth++;
+	}
+
+	// Names with the next bit set move to the new bucket
+	int bit = 1 << b->depth;
+	unsigned low = dir_hash(b->entries[0].name) & (bit - 1);
+	int kept = 0;
+
+	memset(split.data, 0, DISK_BLOCK_SIZE);
+	split.bucket.depth = b->depth + 1;
+	for (int i = 0; i < b->count; i++) {
+		if (dir_hash(b->entries[i].name) & bit)
+			split.bucket.entries[split.bucket.count++] = b->entries[i];
+		else
+			b->entries[kept++] = b->entries[i];
+	}
+	if (!dir_write(d, DIR_FIRST_BUCKET + h->nbuckets, &split))
+		return false;
+	memset(b->entries + kept, 0, (b->count - kept)*sizeof(struct fs_dirent));
+	b->count = kept;
+	b->depth++;
+	dir_write(d, DIR_FIRST_BUCKET + index, bucket);
+
+	// Of the slots leading to the bucket, those with the bit set now
+	// lead to the new one
+	int loaded = 0;
+	for (int slot = low | bit; slot < 1 << depth; slot += 2*bit) {
+		int tb = 1 + slot/POINTERS_PER_BLOCK;
+		if (tb != loaded) {
+			if (loaded)
+				dir_write(d, loaded, &table);
+			dir_read(d, tb, &table);
+			loaded = tb;
+		}
+		table.pointers[slot % POINTERS_PER_BLOCK] = h->nbuckets;
+	}
+	dir_write(d, loaded, &table);
+
+	h->depth = depth;
+	h->nbuckets++;
+	return dir_write(d, 0, &d->header);
+}
+
+// Add a name not yet in the directory. Fails when the directory or the disk is full.
+bool dir_insert(struct dir *d, const char *name, int inumber) {
+	union fs_block bucket;
+	int index;
+
+	while (dir_find(d, name, &index, &bucket) < 0 && bucket.bucket.count == DIRENTS_PER_BLOCK) {
+		if (!dir_split(d, index, &bucket))
+			return false;
+	}
+
+	struct fs_dirent *e = &bucket.bucket.entries[bucket.bucket.count++];
+	memset(e, 0, sizeof(*e));
+	e->inumber = inumber;
+	strcpy(e->name, name);
+	d->header.dir.nentries++;
+	return dir_write(d, DIR_FIRST_BUCKET + index, &bucket) && dir_write(d, 0, &d->header);
+}
+
+// Take a name out of the directory, returning its inumber, or 0 if it was not there
+int dir_remove(struct dir *d, const char *name) {
+	union fs_block bucket;
+	int index;
+	int pos = dir_find(d, name, &index, &bucket);
+	if (pos < 0)
+		return 0;
+
+	struct fs_dirbucket *b = &bucket.bucket;
+	int inumber = b->entries[pos].inumber;
+	b->entries[pos] = b->entries[--b->count];
+	memset(&b->entries[b->count], 0, sizeof(struct fs_dirent));
+	d->header.dir.nentries--;
+	dir_write(d, DIR_FIRST_BUCKET + index, &bucket);
+	dir_write(d, 0, &d->header);
+	return inumber;
+}
+
+// The inumber name has in directory dir, or 0
+int dir_lookup(int dir, const char *name) {
+	union fs_block bucket;
+	struct dir d;
+	int index, inumber = 0;
+
+	pthread_rwlock_rdlock(inode_lock(dir));
+	if (dir_open(&d, dir)) {
+		int pos = dir_find(&d, name, &index, &bucket);
+		if (pos >= 0)
+			inumber = bucket.bucket.entries[pos].inumber;
+	}
+	dir_close(&d);
+	pthread_rwlock_unlock(inode_lock(dir));
+	return inumber;
+}
+
+// Whether an inode is a directory with names in it
+bool dir_busy(int inumber) {
+	struct dir d;
+	bool busy = dir_open(&d, inumber) && d.header.dir.nentries > 0;
+	dir_close(&d);
+	return busy;
+}
+
+/*
+Give a claimed inode a fresh state of the given type, named in parent
+if that is set, with the blocks
+of an empty directory for a directory. The caller holds its inode lock
+exclusively. Fails only when the disk is full.
+*/
+bool node_init(int inumber, int type, int parent) {
+	struct fs_inode *inode = inode_get(inumber);
+	struct dir d;
+
+	inode_clear(inode);
+	inode->isvalid = 1;
+	inode->type = type;
+	inode->parent = parent;
+	inode->inlined = (super.flags & FS_INLINE) && type != INODE_DIR;
+	inode_mark_dirty(inumber);
+	if (type != INODE_DIR)
+		return true;
+
+	dir_attach(&d, inumber);
+	bool ok = dir_format(&d);
+	dir_close(&d);
+	return ok;
+}
+
+// Mount a freshly formatted disk to give it its root directory
+int make_root() {
+	int inumber;
+
+	if (!do_mount())
+		return 0;
+	bool ok = inodemap_claim(&inumber, 1) == 1;
+	if (ok) {
+		journal_begin();
+		pthread_rwlock_wrlock(inode_lock(inumber));
+		ok = node_init(inumber, INODE_DIR, 0);
+		pthread_rwlock_unlock(inode_lock(inumber));
+		journal_end();
+	}
+	if (ok) {
+		super.root = inumber;
+		super_write();
+	}
+	do_unmount();
+	return ok;
+}
+
+// Free a data block of a file being emptied, unless other files share it
+void data_free(struct free_list *fl, int blocknum) {
+	if (dedup_put(blocknum))
+		free_list_add(fl, blocknum, 1);
+}
+
+// Free a pointer block and everything below it, level as in scan_flush
+void free_tree(int blocknum, int level, struct free_list *fl) {
+	union fs_block block;
+
+	// A tree shared with clones stays whole while any of them uses it
+	if (!dedup_put(blocknum))
+		return;
+
+	const union fs_block *pointers = (const union fs_block *)meta_view(blocknum, block.data);
+
+	for (int i = 0; i < POINTERS_PER_BLOCK; i++) {
+		if (pointers->pointers[i] == 0)
+			continue;
+		if (level == 0)
+			data_free(fl, pointers->pointers[i]);
+		else
+			free_tree(pointers->pointers[i], level - 1, fl);
+	}
+	free_list_add(fl, blocknum, 1);
+}
+
+void free_extent(void *arg, int start, int length, bool meta) {
+	free_list_add(arg, start, length);
+}
+
+// Empty a file onto fl; the caller returns the blocks and the inode
+int do_delete(int inumber, struct free_list *fl)
+{
+	struct fs_inode *inode = inode_get(inumber);
+	if (inode->isvalid == 0){  // meaning it's already invalid
+		return 0;
+	}
+
+	// Freed blocks may be handed out again, so no old write can still be pending
+	io_wait_inode(inumber);
+	ra_forget(inumber);
+	inode_deletes[inumber]++;
+	delalloc_discard(inumber);
+
+	if (inode_is_inline(inode)) {
+		inode_clear(inode);
+		inode_mark_dirty(inumber);
+		return 1;
+	}
+	if (super.flags & FS_EXTENTS) {
+		extent_foreach(inode, false, free_extent, fl);
+		inode_clear(inode);
+		inode_mark_dirty(inumber);
+		return 1;
+	}
+	inode->size = 0;
+
+	// Free all inode direct pointers
+	for (int i = 0; i < POINTERS_PER_INODE; i++){
+		if (inode->direct[i] != 0){
+			data_free(fl, inode->direct[i]); // updating the bitmap free list
+			inode->direct[i] = 0;
+		}
+	}
+
+	// Free all inode indirect pointers
+	if (inode->indirect != 0){
+		free_tree(inode->indirect, 0, fl);
+		inode->indirect = 0;
+	}
+	if (super.version >= 1) {
+		if (inode->dindirect != 0)
+			free_tree(inode->dindirect, 1, fl);
+		if (inode->tindirect != 0)
+			free_tree(inode->tindirect, 2, fl);
+		inode->dindirect = 0;
+		inode->tindirect = 0;
+		inode->size_hi = 0;
+	}
+	inode->isvalid = 0;
+	inode_mark_dirty(inumber);
+
+	return 1;
+}
+
+/*
+Delete every valid inode in the list, returning how many were deleted.
+Invalid or free inumbers are skipped, and so are inodes with a name,
+which fs_unlink deletes along with the name. Each delete is a journal operation
+of its own, but the freed blocks and inodes go back to their maps in one
+batch at the end.
+*/
+int fs_delete_many( const int *inumbers, int n )
+{
+	struct free_list fl = {0, 0, 0};
+	int *deleted;
+	int ndeleted = 0;
+
+	pthread_rwlock_rdlock(&fs_lock);
+
+	// Make sure it has been mounted
+	if (!mounted) {
+	 	printf("Error: FS is not mounted. Delete failed\n");
+		pthread_rwlock_unlock(&fs_lock);
+		return 0;
+	}
+
+	// Each inode is deleted at most once, however long the list
+	deleted = malloc((n < super.ninodes ? n : super.ninodes)*sizeof(int));
+	if (!deleted) {
+		printf("Error: Out of memory. Delete failed\n");
+		pthread_rwlock_unlock(&fs_lock);
 		return 0;
 	}
+	for (int i = 0; i < n; i++) {
+		if (!inumberValid(inumbers[i], super.ninodes))
+			continue;
+		journal_begin();
+		pthread_rwlock_wrlock(inode_lock(inumbers[i]));
+		if (!inode_named(inode_get(inumbers[i])) && do_delete(inumbers[i], &fl))
+			deleted[ndeleted++] = inumbers[i];
+		pthread_rwlock_unlock(inode_lock(inumbers[i]));
+		journal_end();
+	}
+	free_list_release(&fl);
+	inodemap_release(deleted, ndeleted);
+	free(deleted);
+
+	pthread_rwlock_unlock(&fs_lock);
+	return ndeleted;
+}
+
+// Inodes on the mounted file system, inode 0 included, or 0 if none is mounted
+int fs_ninodes()
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	int n = mounted ? super.ninodes : 0;
+	pthread_rwlock_unlock(&fs_lock);
+	return n;
+}
+
+int fs_delete(int inumber)
+{
+	return fs_delete_many(&inumber, 1);
+}
+
+long fs_getsize( int inumber )
+{
+	long size = -1;
+
+	pthread_rwlock_rdlock(&fs_lock);
+	if (mounted && inumberValid(inumber, super.ninodes)) {
+		struct fs_inode *inode = inode_get(inumber);
+
+		// Fails for Invalid inodes
+		pthread_rwlock_rdlock(inode_lock(inumber));
+		if (inode->isvalid)
+			size = inode_getsize(inode, super.version);
+		pthread_rwlock_unlock(inode_lock(inumber));
+	}
+	pthread_rwlock_unlock(&fs_lock);
+
+	return size < 0 ? -1 : size;
+}
+
+/*
+Point file block index at a new block from run in place of blocknum,
+which other slots share, for a write to replace it whole. Returns the new
+block, or -1 when the disk is full.
+*/
+int block_copy(struct fs_inode *inode, struct bmap_cursor *c, long index, struct run *run, int blocknum) {
+	int copy = run_take(run);
+	if (copy < 0)
+		return -1;
+	bmap_set(inode, c, index, run, copy);
+	if (dedup_put(blocknum))
+		blocks_release(blocknum, 1);
+	return copy;
+}
+
+// Cluster ci's slots in the block map, 0 for holes
+void cluster_map(struct fs_inode *inode, struct bmap_cursor *c, long ci, int slots[CLUSTER_BLOCKS]) {
+	for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+		slots[i] = bmap(inode, c, ci*CLUSTER_BLOCKS + i, 0, 0);
+		if (slots[i] < 0)
+			slots[i] = 0;
+	}
+}
+
+/*
+Read cluster ci into data, CLUSTER_SIZE bytes with zeros past what it
+holds. A compressed cluster's header comes first, so that only the
+blocks it uses are read; a rewrite may have left more mapped.
+*/
+void cluster_read(int inumber, struct fs_inode *inode, struct bmap_cursor *c, long ci, char *data) {
+	union fs_block packed[CLUSTER_BLOCKS - 1];
+	struct fs_cluster *h = (struct fs_cluster *)packed;
+	int room = sizeof(packed) - sizeof(*h);
+	struct io_wait wait = {0};
+	int slots[CLUSTER_BLOCKS];
+
+	cluster_map(inode, c, ci, slots);
+	memset(data, 0, CLUSTER_SIZE);
+	if (slots[0] == 0)
+		return;
+
+	if (slots[CLUSTER_BLOCKS-1] != 0) {
+		for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+			if (slots[i])
+				io_submit_read(slots[i], data + i*DATA_BLOCK_SIZE, &wait);
+		}
+		io_wait(&wait);
+		return;
+	}
+
+	io_submit_read(slots[0], packed[0].data, &wait);
+	io_wait(&wait);
+	bool ok = h->length >= 0 && h->length <= room && h->size >= 0 && h->size <= CLUSTER_SIZE;
+	int nblocks = ok ? (sizeof(*h) + h->length + DATA_BLOCK_SIZE - 1)/DATA_BLOCK_SIZE : 1;
+	for (int i = 1; i < nblocks; i++) {
+		ok = ok && slots[i] != 0;
+		if (ok)
+			io_submit_read(slots[i], packed[i].data, &wait);
+	}
+	io_wait(&wait);
+
+	const char *payload = (const char *)(h + 1);
+	if (ok && h->method == CLUSTER_STORED && h->length == h->size)
+		memcpy(data, payload, h->size);
+	else if (!ok || h->method != CLUSTER_LZ || lz_decompress(payload, h->length, data, CLUSTER_SIZE) != h->size) {
+		printf("Error: Compressed data of inode %d is damaged\n", inumber);
+		memset(data, 0, CLUSTER_SIZE);
+	}
+}
+
+/*
+Store data as cluster ci, the first size bytes of it being file data,
+compressed if that saves a block and as it is otherwise. A cluster kept
+as it is only has blocks first to last rewritten, the ones changed.
+Returns false when the disk is full.
+*/
+bool cluster_write(int inumber, struct fs_inode *inode, struct bmap_cursor *c, struct run *run, long ci, const char *data, int size, int first, int last) {
+	union fs_block packed[CLUSTER_BLOCKS - 1];
+	struct fs_cluster *h = (struct fs_cluster *)packed;
+	char *payload = (char *)(h + 1);
+	int room = sizeof(packed) - sizeof(*h);
+	int blocknums[CLUSTER_BLOCKS];
+	const char *src = data;
+	int nblocks = CLUSTER_BLOCKS;
+
+	if (bmap(inode, c, ci*CLUSTER_BLOCKS + CLUSTER_BLOCKS - 1, 0, 0) <= 0) {
+		h->method = CLUSTER_LZ;
+		h->length = lz_compress(data, size, payload, room);
+		h->size = size;
+		if ((h->length == 0 || h->length >= size) && size <= room) {
+			h->method = CLUSTER_STORED;
+			h->length = size;
+			memcpy(payload, data, size);
+		}
+		if (h->length > 0) {
+			int used = sizeof(*h) + h->length;
+			nblocks = (used + DATA_BLOCK_SIZE - 1)/DATA_BLOCK_SIZE;
+			memset((char *)packed + used, 0, nblocks*DATA_BLOCK_SIZE - used);
+			src = (const char *)packed;
+		}
+		first = 0;
+		last = nblocks - 1;
+	}
+
+	run->want = nblocks + BMAP_DEPTH;
+	for (int i = 0; i < nblocks; i++) {
+		bool fresh;
+		blocknums[i] = bmap(inode, c, ci*CLUSTER_BLOCKS + i, run, &fresh);
+		if (blocknums[i] < 0)
+			return false;
+		if (fresh) {
+			cache_discard(&blocknums[i], 1);
+			inode->stored++;
+		}
+	}
+
+	// Blocks shared with clones are replaced rather than written over
+	for (int i = first; i <= last; i++) {
+		if (!dedup_claim(blocknums[i])) {
+			blocknums[i] = block_copy(inode, c, ci*CLUSTER_BLOCKS + i, run, blocknums[i]);
+			if (blocknums[i] < 0)
+				return false;
+			cache_discard(&blocknums[i], 1);
+		}
+	}
+
+	for (int i = first; i <= last; i++) {
+		struct wb_slot *slot;
+		char *dblock = wb_slot_get(inumber, &slot);
+		memcpy(dblock, src + i*DATA_BLOCK_SIZE, DATA_BLOCK_SIZE);
+		io_submit_write(blocknums[i], slot);
+	}
+	return true;
+}
+
+// do_read for compressed files, a whole cluster at a time
+int compressed_read(int inumber, struct fs_inode *inode, char *data, int length, long offset) {
+	struct bmap_cursor cursor;
+	char *cluster = malloc(CLUSTER_SIZE);
+	int bytes_read = 0;
+
+	io_wait_inode(inumber);
+	cursor_init(&cursor);
+	while (bytes_read < length) {
+		long pos = offset + bytes_read;
+		int from = pos % CLUSTER_SIZE;
+		int chunk = CLUSTER_SIZE - from < length - bytes_read ? CLUSTER_SIZE - from : length - bytes_read;
+
+		cluster_read(inumber, inode, &cursor, pos/CLUSTER_SIZE, cluster);
+		memcpy(data + bytes_read, cluster + from, chunk);
+		bytes_read += chunk;
+	}
+	cursor_reset(&cursor);
+	free(cluster);
+	return bytes_read;
+}
+
+// do_write for compressed files: each cluster written to is read, changed and stored again
+int compressed_write(int inumber, struct fs_inode *inode, struct bmap_cursor *c, struct run *run, const char *data, int length, long offset) {
+	long size = inode_getsize(inode, super.version);
+	long end = offset + length > size ? offset + length : size;
+	char *cluster = malloc(CLUSTER_SIZE);
+	int bytes_written = 0;
+
+	io_wait_inode(inumber);
+	while (bytes_written < length) {
+		long pos = offset + bytes_written;
+		long ci = pos/CLUSTER_SIZE;
+		int from = pos % CLUSTER_SIZE;
+		int chunk = CLUSTER_SIZE - from < length - bytes_written ? CLUSTER_SIZE - from : length - bytes_written;
+		int held = end - ci*CLUSTER_SIZE < CLUSTER_SIZE ? end - ci*CLUSTER_SIZE : CLUSTER_SIZE;
+
+		if (chunk < CLUSTER_SIZE)
+			cluster_read(inumber, inode, c, ci, cluster);
+		memcpy(cluster + from, data + bytes_written, chunk);
+		if (!cluster_write(inumber, inode, c, run, ci, cluster, held, from/DATA_BLOCK_SIZE, (from + chunk - 1)/DATA_BLOCK_SIZE)) {
+			printf("The disk is full.\n");
+			break;
+		}
+		bytes_written += chunk;
+	}
+	free(cluster);
+	return bytes_written;
+}
+
+// Read from a certain inode, through the read-ahead state of a handle
+// if given one, else through the file's shared one
+int do_read(int inumber, struct readahead *ra, char *data, int length, long offset)
+{
+	struct fs_inode *inode = inode_get(inumber);
+
+	long size = inode_getsize(inode, super.version);
+
+	// Make sure inumber is valid
+	if (!inode->isvalid || inode_is_dir(inode) || offset < 0 || size <= offset || length <= 0)
+		return 0; // fails
+
+	if (inode_is_inline(inode)) {
+		int n = size - offset < length ? size - offset : length;
+		memcpy(data, inode_inline(inode) + offset, n);
+		return n;
+	}
+	if (inode_is_compressed(inode))
+		return compressed_read(inumber, inode, data, size - offset < length ? size - offset : length, offset);
+
+	// Blocks still being written behind, and the read-ahead queued by the
+	// previous call, must land before they are used. A reader left without
+	// read-ahead state makes do with a private one and no prefetching.
+	io_wait_inode(inumber);
+
+	struct readahead own;
+	struct readahead *borrowed = 0;
+	if (!ra)
+		ra = borrowed = ra_get(inumber);
+	if (ra) {
+		io_wait(&ra->wait);
+	} else {
+		ra = &own;
+		memset(ra, 0, offsetof(struct readahead, cursor));
+		cursor_init(&ra->cursor);
+		ra->next_offset = -1;
+		ra->ring = 0;
+	}
+	bool sequential = (offset == ra->next_offset);
+	if (!sequential) {
+		ra->window = RA_MIN;
+		ra->count = 0;
+	}
+
+	int amount_to_read = size - offset < length ? size - offset : length;
+	int first = offset/DATA_BLOCK_SIZE;
+	int last = (offset + amount_to_read - 1)/DATA_BLOCK_SIZE;
+	int nfileblocks = (size + DATA_BLOCK_SIZE - 1)/DATA_BLOCK_SIZE;
+
+	// Find every block this call touches. Prefetched ones are used in
+	// place, the rest are queued at once and complete in any order, and
+	// holes have no block at all.
+	char **buffers = malloc((last - first + 1)*sizeof(char *));
+	char *blocks = malloc((last - first + 1)*DATA_BLOCK_SIZE);
+	struct io_wait wait = {0};
+
+	for (int index = first; index <= last; index++) {
+		int blocknum = ra_blocknum(ra, inode, index);
+		char **buffer = &buffers[index - first];
+
+		if (blocknum <= 0) {
+			*buffer = 0;
+		} else if (index >= ra->start && index < ra->start + ra->count) {
+			*buffer = ra->ring + (index % RA_MAX)*DATA_BLOCK_SIZE;
+		} else {
+			*buffer = blocks + (index - first)*DATA_BLOCK_SIZE;
+			io_submit_read(blocknum, *buffer, &wait);
+		}
+	}
+	io_wait(&wait);
+
+	// Blocks not placed yet are read from the delayed allocation buffer
+	struct delalloc *da = delalloc_find(inumber);
+	for (int index = first; da && index <= last; index++) {
+		if (index >= da->first && index < da->first + da->count)
+			buffers[index - first] = da->data + (index - da->first)*DATA_BLOCK_SIZE;
+	}
+
+	// Copy by length, the first block may start part way in
+	int bytes_read = 0;
+	for (int index = first; index <= last; index++) {
+		int block_offset = (offset + bytes_read) % DATA_BLOCK_SIZE;
+		int chunk = DATA_BLOCK_SIZE - block_offset;
+		if (chunk > amount_to_read - bytes_read)
+			chunk = amount_to_read - bytes_read;
+
+		if (buffers[index - first])
+			memcpy(data + bytes_read, buffers[index - first] + block_offset, chunk);
+		else
+			memset(data + bytes_read, 0, chunk);
+		bytes_read += chunk;
+	}
+	free(buffers);
+	free(blocks);
+
+	// Blocks before the one holding the next offset have been consumed
+	int consumed_to = (offset + bytes_read)/DATA_BLOCK_SIZE;
+	ra->next_offset = offset + bytes_read;
+	if (consumed_to > ra->start) {
+		int consumed = consumed_to - ra->start;
+		ra->count = consumed < ra->count ? ra->count - consumed : 0;
+		ra->start = consumed_to;
+	}
+
+	// Queue the next window without waiting for it, and grow the window
+	if (sequential && ra->ring) {
+		int end = consumed_to + ra->window;
+		if (end > ra->start + RA_MAX)
+			end = ra->start + RA_MAX;
+		if (end > nfileblocks)
+			end = nfileblocks;
+
+		for (int next = ra->start + ra->count; next < end; next++) {
+			int blocknum = ra_blocknum(ra, inode, next);
+			if (blocknum <= 0)
+				break;
+			io_submit_read(blocknum, ra->ring + (next % RA_MAX)*DATA_BLOCK_SIZE, &ra->wait);
+			ra->count++;
+		}
+
+		ra->window *= 2;
+		if (ra->window > RA_MAX)
+			ra->window = RA_MAX;
+	}
 
-	printf("invalid!\n");
+	if (ra == &own)
+		cursor_reset(&own.cursor);
+	else if (ra == borrowed)
+		ra_put(ra);
+	return bytes_read;
+}
 
-	union fs_block iblock; //inode block
-	union fs_block dblock; //data block
-	union fs_block indirect_block;
-	disk_read(iblocknum, iblock.data);
+int fs_read(int inumber, char *data, int length, long offset)
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	int result = 0;
+
+	// Check if mounted
+	if (!mounted){
+		printf("Error: FS is not mounted. Read failed\n");
+	} else if (!inumberValid(inumber,super.ninodes)) {
+		printf("inumber is invalid\n");
+	} else {
+		pthread_rwlock_rdlock(inode_lock(inumber));
+		result = do_read(inumber, 0, data, length, offset);
+		pthread_rwlock_unlock(inode_lock(inumber));
+	}
+
+	pthread_rwlock_unlock(&fs_lock);
+	return result;
+}
+
+int do_write(int inumber, struct bmap_cursor *c, const char *data, int length, long offset);
+
+// Move a small file's data out of its inode into a block, as it outgrows it
+void inline_promote(int inumber, struct fs_inode *inode, struct bmap_cursor *c) {
+	char data[INODE_SIZE_INLINE];
+	int size = inode->size;
+
+	memcpy(data, inode_inline(inode), size);
+	memset(inode_inline(inode), 0, inline_capacity());
+	inode->inlined = 0;
+	inode_setsize(inode, 0);
+	if (size > 0)
+		do_write(inumber, c, data, size, 0);
+	inode_mark_dirty(inumber);
+}
 
-	if (!iblock.inode[inumber].isvalid)
+/*
+Write part of file block index on a FS_DEDUP file system. The block's new
+contents are hashed and, when another block already holds them, the file
+shares that one instead of writing anything. Otherwise the block is
+written over in place if the file is its only user, or copied to a new
+block if not. Returns false when the disk is full.
+*/
+bool dedup_write(int inumber, struct fs_inode *inode, struct bmap_cursor *c, struct run *run, long index, const char *data, int offset, int length) {
+	char block[DATA_BLOCK_SIZE];
+	int old = bmap(inode, c, index, 0, 0);
+	if (old < 0)
+		return false;
+
+	// The old block must not have a write in flight, and keeps the
+	// bytes around a partial write
+	if (old > 0)
+		io_wait_inode(inumber);
+	if (old > 0 && length < DATA_BLOCK_SIZE) {
+		struct io_wait wait = {0};
+		io_submit_read(old, block, &wait);
+		io_wait(&wait);
+	} else if (length < DATA_BLOCK_SIZE) {
+		memset(block, 0, DATA_BLOCK_SIZE);
+	}
+	memcpy(block + offset, data, length);
+	uint64_t hash = block_hash(block);
+
+	// Writing back what the block holds already changes nothing
+	if (old > 0 && dedup_holds(old, hash) && block_matches(old, block))
+		return true;
+
+	int shared = dedup_share(block, hash);
+	if (shared > 0) {
+		if (bmap_set(inode, c, index, run, shared) < 0) {
+			if (dedup_put(shared))
+				blocks_release(shared, 1);
+			return false;
+		}
+		if (old > 0 && dedup_put(old))
+			blocks_release(old, 1);
+		return true;
+	}
+
+	// Only a block under pointer blocks of this file's own can be its alone
+	if (old > 0 && bmap_set(inode, c, index, run, old) < 0)
+		return false;
+	int blocknum = old;
+	if (old == 0 || !dedup_claim(old)) {
+		blocknum = old == 0 ? bmap(inode, c, index, run, 0) : block_copy(inode, c, index, run, old);
+		if (blocknum < 0)
+			return false;
+		cache_discard(&blocknum, 1);
+	}
+
+	// Entered once queued, so that a file finding it compares the queued copy
+	struct wb_slot *slot;
+	memcpy(wb_slot_get(inumber, &slot), block, DATA_BLOCK_SIZE);
+	io_submit_write(blocknum, slot);
+	dedup_add(blocknum, hash);
+	return true;
+}
+
+// Write to a certain inode, mapping it with the cursor of a handle if
+// given one, else with a cursor of its own
+int do_write(int inumber, struct bmap_cursor *c, const char *data, int length, long offset)
+{
+	struct fs_inode *inode = inode_get(inumber);
+
+	if (!inode->isvalid || inode_is_dir(inode) || offset < 0 || length <= 0)
 		return 0; //fails
+	ra_forget(inumber);
+
+	// Writes past the largest file size are cut short
+	long max_size = max_file_blocks(super.version)*DATA_BLOCK_SIZE;
+	if (offset >= max_size) {
+		printf("The file is full.\n");
+		return 0;
+	}
+	if (length > max_size - offset)
+		length = max_size - offset;
 
-	int free_block, free_pointers_block;
-	bool direct_found;
+	if (inode_is_inline(inode)) {
+		if (offset + length <= inline_capacity()) {
+			memcpy(inode_inline(inode) + offset, data, length);
+			if (offset + length > inode_getsize(inode, super.version))
+				inode_setsize(inode, offset + length);
+			inode_mark_dirty(inumber);
+			return length;
+		}
+		inline_promote(inumber, inode, c);
+	}
+
+	// Pointer blocks are read and written at most once per call while
+	// the writes stay within them
+	struct bmap_cursor own;
+	struct bmap_cursor *cursor = c ? c : &own;
+	if (!c)
+		cursor_init(&own);
+
+	struct run run = {0, 0, 0, 0};
 	int bytes_written = 0;
-	int amount_to_write = length;
 
-	while (amount_to_write > 0) {
-		direct_found = false;
+	// Compressed files go a cluster at a time instead, and files on
+	// deduplicating file systems skip the delayed allocation
+	bool compressed = inode_is_compressed(inode);
+	bool dedup = (super.flags & FS_DEDUP) != 0;
+	if (compressed)
+		bytes_written = compressed_write(inumber, inode, cursor, &run, data, length, offset);
+
+	while (!compressed && bytes_written < length) {
+		long pos = offset + bytes_written;
+		long index = pos/DATA_BLOCK_SIZE;
+		int block_offset = pos % DATA_BLOCK_SIZE;
+		int chunk = DATA_BLOCK_SIZE - block_offset;
+		if (chunk > length - bytes_written)
+			chunk = length - bytes_written;
+
+		// Blocks still to be written in this call, plus room for the
+		// pointer blocks mapping them, if a new run has to be reserved
+		int nleft = (block_offset + length - bytes_written + DATA_BLOCK_SIZE - 1)/DATA_BLOCK_SIZE;
+		run.want = nleft + nleft/POINTERS_PER_BLOCK + BMAP_DEPTH;
+
+		if (dedup) {
+			if (!dedup_write(inumber, inode, cursor, &run, index, data + bytes_written, block_offset, chunk)) {
+				printf("The disk is full.\n");
+				break;
+			}
+			bytes_written += chunk;
+			continue;
+		}
 
-		free_block = find_free_block(block.super.nblocks);
+		// New blocks are buffered when they can be, and placed later
+		int blocknum = bmap(inode, cursor, index, 0, 0);
+		char *buffered = blocknum == 0 ? delalloc_block(inumber, inode, cursor, index) : 0;
+		if (buffered) {
+			memcpy(buffered + block_offset, data + bytes_written, chunk);
+			bytes_written += chunk;
+			continue;
+		}
 
-		if (free_block == -1) {
+		// Missing pointer blocks are placed ahead of the data they point to
+		bool fresh = false;
+		if (blocknum == 0)
+			blocknum = bmap(inode, cursor, index, &run, &fresh);
+		if (blocknum < 0) {
 			printf("The disk is full.\n");
-			return bytes_written;
+			break;
+		}
+
+		// An existing block must not have another write in flight, and
+		// keeps the bytes around a partial overwrite. The wait comes before
+		// claiming a buffer, which would count as one of the writes.
+		if (!fresh)
+			io_wait_inode(inumber);
+
+		struct wb_slot *slot;
+		char *dblock = wb_slot_get(inumber, &slot);
+
+		if (fresh) {
+			// New blocks, including ones filling a hole, start out zeroed
+			memset(dblock, 0, DATA_BLOCK_SIZE);
+			cache_discard(&blocknum, 1);
+		} else {
+			if (chunk < DATA_BLOCK_SIZE) {
+				struct io_wait wait = {0};
+				io_submit_read(blocknum, dblock, &wait);
+				io_wait(&wait);
+			}
+		}
+		memcpy(dblock + block_offset, data + bytes_written, chunk);
+		bytes_written += chunk;
+
+		// Queue the data block and move on without waiting for it
+		io_submit_write(blocknum, slot);
+	}
+
+	cursor_flush(cursor, inode);
+	if (!c)
+		cursor_reset(&own);
+
+	if (offset + bytes_written > inode_getsize(inode, super.version))
+		inode_setsize(inode, offset + bytes_written);
+	inode_mark_dirty(inumber);
+
+	// Hand back whatever part of the reservation went unused
+	run_release(&run);
+
+	return bytes_written;
+}
+
+int fs_write(int inumber, const char *data, int length, long offset)
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	int result = 0;
+
+	//Check if mounted
+	if(!mounted){
+		printf("Error: FS is not mounted. Write failed\n");
+	} else if (!inumberValid(inumber,super.ninodes)) {
+		printf("inumber is invalid\n");
+	} else {
+		journal_begin();
+		pthread_rwlock_wrlock(inode_lock(inumber));
+		result = do_write(inumber, 0, data, length, offset);
+		pthread_rwlock_unlock(inode_lock(inumber));
+		journal_end();
+	}
+
+	pthread_rwlock_unlock(&fs_lock);
+	return result;
+}
+
+int fs_compress( int inumber )
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	int result = 0;
+
+	if (!mounted) {
+		printf("Error: FS is not mounted. Compress failed\n");
+	} else if (!(super.flags & FS_COMPRESS)) {
+		printf("Error: FS was not formatted for compression. Compress failed\n");
+	} else if (!inumberValid(inumber, super.ninodes)) {
+		printf("inumber is invalid\n");
+	} else {
+		journal_begin();
+		pthread_rwlock_wrlock(inode_lock(inumber));
+		struct fs_inode *inode = inode_get(inumber);
+
+		// Data already written stays as it is, so only empty files can switch
+		if (inode->isvalid && !inode_is_dir(inode) && inode_getsize(inode, super.version) == 0) {
+			ra_forget(inumber);
+			delalloc_discard(inumber);
+			inode->inlined = 0;
+			inode->compressed = 1;
+			inode_mark_dirty(inumber);
+			result = 1;
+		} else if (inode->isvalid && !inode_is_dir(inode)) {
+			printf("Error: File is not empty. Compress failed\n");
+		}
+		pthread_rwlock_unlock(inode_lock(inumber));
+		journal_end();
+	}
+
+	pthread_rwlock_unlock(&fs_lock);
+	return result;
+}
+
+/*
+Make clone, a claimed inode, a copy of the file inumber that shares all
+its blocks, taking one more use of each block its inode points to. The
+pointer blocks below are shared whole, and copied on the next write.
+*/
+bool do_clone(int inumber, int clone) {
+	struct fs_inode *inode = inode_get(inumber);
+	if (!inode->isvalid || inode_is_dir(inode))
+		return false;
+
+	// Writes in flight must land before the clone can read the blocks
+	io_wait_inode(inumber);
+	ra_forget(clone);
+	struct fs_inode *copy = inode_get(clone);
+	memcpy(copy, inode, super.inode_size);
+	copy->parent = 0;
+	if (!inode_is_inline(inode)) {
+		for (int k = 0; k < POINTERS_PER_INODE; k++) {
+			if (inode->direct[k] != 0)
+				dedup_get(inode->direct[k]);
+		}
+		if (inode->indirect != 0)
+			dedup_get(inode->indirect);
+		if (inode->dindirect != 0)
+			dedup_get(inode->dindirect);
+		if (inode->tindirect != 0)
+			dedup_get(inode->tindirect);
+	}
+	inode_mark_dirty(clone);
+	return true;
+}
+
+int fs_clone( int inumber )
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	int clone = 0;
+
+	if (!mounted) {
+		printf("Error: FS is not mounted. Clone failed\n");
+	} else if (!(super.flags & FS_DEDUP)) {
+		printf("Error: FS was not formatted for dedup. Clone failed\n");
+	} else if (!inumberValid(inumber, super.ninodes)) {
+		printf("inumber is invalid\n");
+	} else if (inodemap_claim(&clone, 1)) {
+		journal_begin();
+		inode_lock_pair(inumber, clone);
+		bool cloned = do_clone(inumber, clone);
+		inode_unlock_pair(inumber, clone);
+		journal_end();
+		if (!cloned) {
+			inodemap_release(&clone, 1);
+			clone = 0;
+		}
+	}
+
+	pthread_rwlock_unlock(&fs_lock);
+	return clone;
+}
+
+/*
+Clone every file at once, as one journal operation, with the file system
+to itself so that no write lands part way through. Either every file is
+cloned or, when there are not inodes enough, none is. fn is then called
+with each file and its clone. Returns how many files were cloned.
+*/
+int fs_snapshot( void (*fn)( int inumber, int clone, void *arg ), void *arg )
+{
+	pthread_rwlock_wrlock(&fs_lock);
+	int n = 0;
+	int *inumbers = 0;
+	int *clones = 0;
+
+	if (!mounted) {
+		printf("Error: FS is not mounted. Snapshot failed\n");
+	} else if (!(super.flags & FS_DEDUP)) {
+		printf("Error: FS was not formatted for dedup. Snapshot failed\n");
+	} else {
+		inumbers = malloc(super.ninodes*sizeof(int));
+		clones = malloc(super.ninodes*sizeof(int));
+		for (int inumber = 1; inumber < super.ninodes; inumber++) {
+			struct fs_inode *inode = inode_get(inumber);
+			if (inode->isvalid && !inode_is_dir(inode))
+				inumbers[n++] = inumber;
+		}
+
+		int found = inodemap_claim(clones, n);
+		if (found < n) {
+			printf("Error: Not enough free inodes. Snapshot failed\n");
+			inodemap_release(clones, found);
+			n = 0;
+		}
+		journal_begin();
+		for (int i = 0; i < n; i++) {
+			do_clone(inumbers[i], clones[i]);
+		}
+		journal_end();
+	}
+	pthread_rwlock_unlock(&fs_lock);
+
+	for (int i = 0; fn && i < n; i++) {
+		fn(inumbers[i], clones[i], arg);
+	}
+	free(inumbers);
+	free(clones);
+	return n;
+}
+
+int fs_open( int inumber )
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	int fd = -1;
+
+	if (!mounted) {
+		printf("Error: FS is not mounted. Open failed\n");
+	} else if (!inumberValid(inumber, super.ninodes)) {
+		printf("inumber is invalid\n");
+	} else {
+		pthread_rwlock_rdlock(inode_lock(inumber));
+		struct fs_inode *inode = inode_get(inumber);
+
+		// Fails for invalid inodes and directories
+		bool file = inode->isvalid && !inode_is_dir(inode);
+		pthread_mutex_lock(&handle_lock);
+		for (int i = 0; i < OPEN_FILES && fd < 0 && file; i++) {
+			if (handles[i].inumber == 0)
+				fd = i;
+		}
+		if (fd >= 0) {
+			struct handle *h = &handles[fd];
+			h->inumber = inumber;
+			h->inode = inode;
+			h->position = 0;
+			h->changes = inode_changes[inumber];
+			h->deletes = inode_deletes[inumber];
+			h->written = false;
+			h->ra.inumber = inumber;
+			h->ra.window = RA_MIN;
+			cursor_init(&h->ra.cursor);
+		} else if (file) {
+			printf("Error: Too many open files. Open failed\n");
+		}
+		pthread_mutex_unlock(&handle_lock);
+		pthread_rwlock_unlock(inode_lock(inumber));
+	}
+
+	pthread_rwlock_unlock(&fs_lock);
+	return fd;
+}
+
+// New blocks still buffered for the file are placed once it is closed
+int fs_close( int fd )
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	int result = 0;
+	struct handle *h = handle_get(fd);
+
+	if (!mounted) {
+		printf("Error: FS is not mounted. Close failed\n");
+	} else if (!h) {
+		printf("Error: Bad file handle. Close failed\n");
+	} else {
+		if (h->written) {
+			journal_begin();
+			pthread_rwlock_wrlock(inode_lock(h->inumber));
+			struct delalloc *da = handle_check(h) ? delalloc_find(h->inumber) : 0;
+			if (da) {
+				delalloc_flush(da, h->inode, &h->ra.cursor);
+				cursor_flush(&h->ra.cursor, h->inode);
+			}
+			pthread_rwlock_unlock(inode_lock(h->inumber));
+			journal_end();
+		}
+		handle_release(h);
+		result = 1;
+	}
+
+	pthread_rwlock_unlock(&fs_lock);
+	return result;
+}
+
+long fs_seek( int fd, long offset )
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	long result = -1;
+	struct handle *h = handle_get(fd);
+
+	if (!mounted) {
+		printf("Error: FS is not mounted. Seek failed\n");
+	} else if (!h) {
+		printf("Error: Bad file handle. Seek failed\n");
+	} else if (offset >= 0) {
+		h->position = offset;
+		result = offset;
+	}
+
+	pthread_rwlock_unlock(&fs_lock);
+	return result;
+}
+
+// Read at the handle's position and move past what was read
+int fs_fread( int fd, char *data, int length )
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	int result = 0;
+	struct handle *h = handle_get(fd);
+
+	if (!mounted) {
+		printf("Error: FS is not mounted. Read failed\n");
+	} else if (!h) {
+		printf("Error: Bad file handle. Read failed\n");
+	} else {
+		if (!h->ra.ring)
+			h->ra.ring = malloc(RA_MAX*DATA_BLOCK_SIZE);
+		pthread_rwlock_rdlock(inode_lock(h->inumber));
+		if (handle_check(h))
+			result = do_read(h->inumber, &h->ra, data, length, h->position);
+		pthread_rwlock_unlock(inode_lock(h->inumber));
+		h->position += result;
+	}
+
+	pthread_rwlock_unlock(&fs_lock);
+	return result;
+}
+
+// Write at the handle's position and move past what was written
+int fs_fwrite( int fd, const char *data, int length )
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	int result = 0;
+	struct handle *h = handle_get(fd);
+
+	if (!mounted) {
+		printf("Error: FS is not mounted. Write failed\n");
+	} else if (!h) {
+		printf("Error: Bad file handle. Write failed\n");
+	} else {
+		journal_begin();
+		pthread_rwlock_wrlock(inode_lock(h->inumber));
+		if (handle_check(h)) {
+			result = do_write(h->inumber, &h->ra.cursor, data, length, h->position);
+
+			// The map went with the write, the prefetched blocks may not have
+			h->ra.count = 0;
+			h->changes = inode_changes[h->inumber];
+			h->written = true;
 		}
+		pthread_rwlock_unlock(inode_lock(h->inumber));
+		journal_end();
+		h->position += result;
+	}
+
+	pthread_rwlock_unlock(&fs_lock);
+	return result;
+}
+
+// Read until length bytes or the end, returning the bytes read, or -1
+long host_read(int fd, char *data, long length) {
+	long done = 0;
+	while (done < length) {
+		ssize_t n = read(fd, data + done, length - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+// Write all length bytes, returning false if the descriptor fails
+bool host_write(int fd, const char *data, long length) {
+	long done = 0;
+	while (done < length) {
+		ssize_t n = write(fd, data + done, length - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		done += n;
+	}
+	return true;
+}
+
+/*
+Map file blocks [first, first+n) for a write that replaces them whole,
+placing the missing ones, and fill in blocknums for as many as could be
+mapped before the disk filled. Buffered new blocks are placed first so
+the whole range is on disk, and the blocks end up with no older write in
+flight and no cached copy. The caller holds the inode lock exclusively.
+*/
+int map_whole_blocks(int inumber, struct fs_inode *inode, struct bmap_cursor *c, long first, int n, int *blocknums) {
+	struct delalloc *da = delalloc_find(inumber);
+	struct run run = {0, 0, 0, 0};
+	int mapped;
+
+	if (da)
+		delalloc_flush(da, inode, c);
+	io_wait_inode(inumber);
+	ra_forget(inumber);
+
+	for (mapped = 0; mapped < n; mapped++) {
+		int left = n - mapped;
+		run.want = left + left/POINTERS_PER_BLOCK + BMAP_DEPTH;
+		blocknums[mapped] = bmap(inode, c, first + mapped, &run, 0);
+		if (blocknums[mapped] < 0)
+			break;
+	}
+	run_release(&run);
+	cache_discard(blocknums, mapped);
+	return mapped;
+}
 
-		const char *temp = &data[bytes_written];
+/*
+Copy from a host descriptor into a file, starting at the start of the
+file, STREAM_BLOCKS at a time. Regular files go from the descriptor to
+the disk without passing through memory here; anything else, such as
+a pipe, is read into a buffer before the locks are taken. Whole blocks
+are written in place, and only a part block at the end takes do_write's
+path. Returns the bytes copied, or -1 if the descriptor fails.
+*/
+long do_import(int inumber, int fd) {
+	struct stat st;
+	bool direct = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+	long left = 0;
+
+	// Compressed files, and any on a deduplicating file system, take
+	// do_write's path for all of it, through the buffer
+	pthread_rwlock_rdlock(inode_lock(inumber));
+	bool compressed = inode_is_compressed(inode_get(inumber));
+	pthread_rwlock_unlock(inode_lock(inumber));
+	bool blockwise = compressed || (super.flags & FS_DEDUP);
+	direct = direct && !blockwise;
+	if (direct) {
+		off_t pos = lseek(fd, 0, SEEK_CUR);
+		direct = pos >= 0;
+		left = st.st_size - pos;
+	}
 
-		// Important! Clear the data block before writing to it
-		for (int i = 0; i < DISK_BLOCK_SIZE; i++)
-			dblock.data[i] = 0;
+	long max_size = max_file_blocks(super.version)*DATA_BLOCK_SIZE;
+	char *buffer = malloc(direct ? DATA_BLOCK_SIZE : STREAM_BLOCKS*DATA_BLOCK_SIZE);
+	int *blocknums = malloc(STREAM_BLOCKS*sizeof(int));
+	long copied = 0;
+	bool failed = false;
 
-		//check if temp is bigger than data block size, write up to data block size only
-		if(amount_to_write > DATA_BLOCK_SIZE){
-			strncpy(dblock.data, temp, DATA_BLOCK_SIZE);
-			bytes_written += DATA_BLOCK_SIZE;
+	while (!failed) {
+		long length = STREAM_BLOCKS*DATA_BLOCK_SIZE;
+		if (!direct)
+			length = host_read(fd, buffer, length);
+		else if (length > left)
+			length = left;
+		if (length < 0 && !direct)
+			failed = true;
+		if (length <= 0)
+			break;
+		if (copied >= max_size) {
+			printf("The file is full.\n");
+			break;
 		}
-		else{
-			strncpy(dblock.data, temp, amount_to_write);
-			bytes_written += amount_to_write;
+		if (length > max_size - copied)
+			length = max_size - copied;
+
+		journal_begin();
+		pthread_rwlock_wrlock(inode_lock(inumber));
+		struct fs_inode *inode = inode_get(inumber);
+		if (!inode->isvalid || inode_is_dir(inode) || inode_is_compressed(inode) != compressed) {
+			pthread_rwlock_unlock(inode_lock(inumber));
+			journal_end();
+			break;
 		}
 
-		disk_write(free_block, dblock.data);
-		bitmap[free_block] = 0;
-		amount_to_write = length - bytes_written;
+		struct bmap_cursor cursor;
+		cursor_init(&cursor);
+		if (inode_is_inline(inode) && copied + length > inline_capacity())
+			inline_promote(inumber, inode, &cursor);
+
+		int nblocks = blockwise ? 0 : length/DATA_BLOCK_SIZE;
+		int mapped = map_whole_blocks(inumber, inode, &cursor, copied/DATA_BLOCK_SIZE, nblocks, blocknums);
+		long moved = 0;
 
-		//Searhing for an available direct pointer for free block
-		for (int i = 0; i < POINTERS_PER_INODE; i++) {
-			if (iblock.inode[inumber].direct[i] == 0) {
-				iblock.inode[inumber].direct[i] = free_block;
-				direct_found = true;
-				disk_write(iblocknum, iblock.data);
+		// Runs of consecutive blocks go in one transfer each
+		for (int i = 0; i < mapped; ) {
+			int j = i + 1;
+			while (j < mapped && blocknums[j] == blocknums[j-1] + 1)
+				j++;
+
+			long bytes = (long)(j - i)*DATA_BLOCK_SIZE;
+			long n = bytes;
+			if (direct)
+				n = disk_receive(blocknums[i], bytes, fd);
+			else
+				disk_write_run(blocknums[i], j - i, buffer + (long)i*DATA_BLOCK_SIZE);
+			if (n < 0)
+				failed = true;
+			if (n < bytes) {
+				moved += n > 0 ? n : 0;
 				break;
 			}
+			moved += n;
+			i = j;
+		}
+		if (mapped < nblocks)
+			printf("The disk is full.\n");
+
+		bool whole = !failed && moved == (long)nblocks*DATA_BLOCK_SIZE;
+		if (whole && length > moved) {
+			char *tail = direct ? buffer : buffer + moved;
+			long n = direct ? host_read(fd, tail, length - moved) : length - moved;
+			if (n < 0)
+				failed = true;
+			else
+				moved += do_write(inumber, &cursor, tail, n, copied + moved);
 		}
 
-		// Look for free indirect field in inode
-		if (!direct_found) {
-			// Map to a new indirect block
-			if (iblock.inode[inumber].indirect == 0) {
-				free_pointers_block = find_free_block(block.super.nblocks);
-				iblock.inode[inumber].indirect = free_pointers_block;
-				disk_read(free_pointers_block, indirect_block.data);
-				indirect_block.pointers[0] = free_block;
-				// Initialize pointers block
-				for (int i = 1; i < POINTERS_PER_BLOCK; i++) {
-					indirect_block.pointers[i] = 0;
-				}
-				disk_write(free_pointers_block, indirect_block.data);
-				bitmap[free_pointers_block] = 0;
+		cursor_flush(&cursor, inode);
+		cursor_reset(&cursor);
+		if (copied + moved > inode_getsize(inode, super.version))
+			inode_setsize(inode, copied + moved);
+		inode_mark_dirty(inumber);
+		pthread_rwlock_unlock(inode_lock(inumber));
+		journal_end();
+
+		copied += moved;
+		left -= moved;
+		if (moved < length)
+			break;
+	}
+
+	free(buffer);
+	free(blocknums);
+	return failed ? -1 : copied;
+}
+
+/*
+Copy a file out to a host descriptor, STREAM_BLOCKS at a time. Runs of
+consecutive blocks are sent by the disk straight from the image; holes
+are written as zeros and blocks not placed yet from their buffer.
+Returns the bytes copied, or -1 if the descriptor fails.
+*/
+long do_export(int inumber, int fd) {
+	static const char zeros[DATA_BLOCK_SIZE];
+	int *blocknums = malloc(STREAM_BLOCKS*sizeof(int));
+	char *buffer = 0;
+	long copied = 0;
+	bool failed = false;
+
+	while (!failed) {
+		pthread_rwlock_rdlock(inode_lock(inumber));
+		struct fs_inode *inode = inode_get(inumber);
+		long size = inode->isvalid && !inode_is_dir(inode) ? inode_getsize(inode, super.version) : 0;
+		if (copied >= size) {
+			pthread_rwlock_unlock(inode_lock(inumber));
+			break;
+		}
+		long length = size - copied;
+		if (length > STREAM_BLOCKS*DATA_BLOCK_SIZE)
+			length = STREAM_BLOCKS*DATA_BLOCK_SIZE;
+
+		if (inode_is_inline(inode)) {
+			failed = !host_write(fd, inode_inline(inode) + copied, length);
+			pthread_rwlock_unlock(inode_lock(inumber));
+			copied += length;
+			continue;
+		}
+
+		// Compressed files are decompressed through a buffer
+		if (inode_is_compressed(inode)) {
+			if (!buffer)
+				buffer = malloc(STREAM_BLOCKS*DATA_BLOCK_SIZE);
+			int n = compressed_read(inumber, inode, buffer, length, copied);
+			failed = !host_write(fd, buffer, n);
+			pthread_rwlock_unlock(inode_lock(inumber));
+			copied += length;
+			continue;
+		}
+
+		// Blocks still being written behind must land before they are sent
+		io_wait_inode(inumber);
+
+		// Mapped blocks by number, holes as 0, buffered blocks as -1
+		struct bmap_cursor cursor;
+		struct delalloc *da = delalloc_find(inumber);
+		long first = copied/DATA_BLOCK_SIZE;
+		int n = (length + DATA_BLOCK_SIZE - 1)/DATA_BLOCK_SIZE;
+
+		cursor_init(&cursor);
+		for (int i = 0; i < n; i++) {
+			long index = first + i;
+			if (da && index >= da->first && index < da->first + da->count)
+				blocknums[i] = -1;
+			else if ((blocknums[i] = bmap(inode, &cursor, index, 0, 0)) < 0)
+				blocknums[i] = 0;
+		}
+		cursor_reset(&cursor);
+
+		for (int i = 0; i < n && !failed; ) {
+			int j = i + 1;
+			while (j < n && (blocknums[i] > 0 ? blocknums[j] == blocknums[j-1] + 1 : blocknums[j] == blocknums[i]))
+				j++;
+
+			long offset = (long)i*DATA_BLOCK_SIZE;
+			long bytes = (long)j*DATA_BLOCK_SIZE < length ? (long)(j - i)*DATA_BLOCK_SIZE : length - offset;
+			if (blocknums[i] > 0) {
+				failed = disk_send(blocknums[i], bytes, fd) < bytes;
+			} else if (blocknums[i] < 0) {
+				failed = !host_write(fd, da->data + (first + i - da->first)*DATA_BLOCK_SIZE, bytes);
+			} else {
+				for (long done = 0; done < bytes && !failed; done += DATA_BLOCK_SIZE)
+					failed = !host_write(fd, zeros, bytes - done < DATA_BLOCK_SIZE ? bytes - done : DATA_BLOCK_SIZE);
 			}
-			// Look for free pointers in existing indirect pointers block
-			else {
-				disk_read(iblock.inode[inumber].indirect, indirect_block.data);
-				for (int i = 0; i < POINTERS_PER_BLOCK; i++) {
-					if (indirect_block.pointers[i] == 0) {
-						indirect_block.pointers[i] = free_block;
-						break;
-					}
-				}
-				disk_write(iblock.inode[inumber].indirect, indirect_block.data);
+			i = j;
+		}
+		pthread_rwlock_unlock(inode_lock(inumber));
+
+		copied += length;
+	}
+
+	free(blocknums);
+	free(buffer);
+	return failed ? -1 : copied;
+}
+
+long fs_import( int inumber, int fd )
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	long result = 0;
+
+	if (!mounted) {
+		printf("Error: FS is not mounted. Import failed\n");
+	} else if (!inumberValid(inumber, super.ninodes)) {
+		printf("inumber is invalid\n");
+	} else {
+		result = do_import(inumber, fd);
+	}
+
+	pthread_rwlock_unlock(&fs_lock);
+	return result;
+}
+
+long fs_export( int inumber, int fd )
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	long result = 0;
+
+	if (!mounted) {
+		printf("Error: FS is not mounted. Export failed\n");
+	} else if (!inumberValid(inumber, super.ninodes)) {
+		printf("inumber is invalid\n");
+	} else {
+		result = do_export(inumber, fd);
+	}
+
+	pthread_rwlock_unlock(&fs_lock);
+	return result;
+}
+
+/*
+Split a path into the directory holding its last name and that name,
+copied into last: the directory's inumber, or 0 when one on the way is
+missing or a name is too long. The root gives an empty name.
+*/
+int path_parent(const char *path, char last[FS_NAME_MAX+1]) {
+	int dir = super.root;
+
+	last[0] = 0;
+	while (*path) {
+		while (*path == '/')
+			path++;
+		if (!*path)
+			break;
+		size_t len = strcspn(path, "/");
+		if (len > FS_NAME_MAX)
+			return 0;
+		if (last[0] && !(dir = dir_lookup(dir, last)))
+			return 0;
+		memcpy(last, path, len);
+		last[len] = 0;
+		path += len;
+	}
+	return dir;
+}
+
+/*
+Make an inode of the given type under a new name. Claiming the inode,
+setting it up and naming it are one journal operation, so a crash
+leaves either all of it or none.
+*/
+int do_make(const char *path, int type) {
+	char name[FS_NAME_MAX+1];
+	struct free_list fl = {0, 0, 0};
+	union fs_block bucket;
+	struct dir d;
+	int index, inumber;
+
+	int parent = path_parent(path, name);
+	if (!parent || !name[0] || !inodemap_claim(&inumber, 1))
+		return 0;
+
+	journal_begin();
+	inode_lock_pair(parent, inumber);
+	bool ok = dir_open(&d, parent) && dir_find(&d, name, &index, &bucket) < 0;
+	if (ok) {
+		ok = node_init(inumber, type, parent) && dir_insert(&d, name, inumber);
+		if (!ok)
+			do_delete(inumber, &fl);
+	}
+	dir_close(&d);
+	inode_unlock_pair(parent, inumber);
+	journal_end();
+
+	free_list_release(&fl);
+	if (!ok) {
+		inodemap_release(&inumber, 1);
+		inumber = 0;
+	}
+	return inumber;
+}
+
+// Drop a name, and delete what it names; directories must be empty
+int do_unlink(const char *path) {
+	char name[FS_NAME_MAX+1];
+	struct free_list fl = {0, 0, 0};
+	union fs_block bucket;
+	struct dir d;
+	int index, inumber, deleted = 0;
+	bool ok = false;
+
+	int parent = path_parent(path, name);
+	if (!parent || !name[0])
+		return 0;
+
+	/*
+	The named inode is only known after a lookup, and both locks are
+	needed in stripe order, so look first and check again once locked.
+	*/
+	while ((inumber = dir_lookup(parent, name))) {
+		journal_begin();
+		inode_lock_pair(parent, inumber);
+		int pos = dir_open(&d, parent) ? dir_find(&d, name, &index, &bucket) : -1;
+		bool same = pos >= 0 && bucket.bucket.entries[pos].inumber == inumber;
+		if (same) {
+			ok = !dir_busy(inumber);
+			if (ok) {
+				dir_remove(&d, name);
+				if (do_delete(inumber, &fl))
+					deleted = inumber;
+			} else {
+				printf("Error: Directory %s is not empty. Unlink failed\n", path);
 			}
 		}
+		dir_close(&d);
+		inode_unlock_pair(parent, inumber);
+		journal_end();
+		if (same || pos < 0)
+			break;
+	}
+
+	free_list_release(&fl);
+	if (deleted)
+		inodemap_release(&deleted, 1);
+	return ok;
+}
+
+int do_listdir(int inumber, void (*fn)( const char *name, int inumber, void *arg ), void *arg) {
+	union fs_block bucket;
+	struct dir d;
 
-		iblock.inode[inumber].size += strlen(dblock.data);
-		disk_write(iblocknum, iblock.data);
+	pthread_rwlock_rdlock(inode_lock(inumber));
+	bool ok = dir_open(&d, inumber);
+	for (int i = 0; ok && i < d.header.dir.nbuckets; i++) {
+		dir_read(&d, DIR_FIRST_BUCKET + i, &bucket);
+		for (int j = 0; j < bucket.bucket.count; j++)
+			fn(bucket.bucket.entries[j].name, bucket.bucket.entries[j].inumber, arg);
 	}
+	dir_close(&d);
+	pthread_rwlock_unlock(inode_lock(inumber));
+	return ok;
+}
 
-	return bytes_written;
+// Whether the name calls can go ahead, printing why not
+bool names_usable(const char *what) {
+	if (!mounted) {
+		printf("Error: FS is not mounted. %s failed\n", what);
+		return false;
+	}
+	if (!(super.flags & FS_DIRECTORIES)) {
+		printf("Error: FS has no directories. %s failed\n", what);
+		return false;
+	}
+	return true;
+}
+
+int fs_mkdir( const char *path )
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	int inumber = names_usable("Mkdir") ? do_make(path, INODE_DIR) : 0;
+	pthread_rwlock_unlock(&fs_lock);
+	return inumber;
+}
+
+int fs_create_path( const char *path )
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	int inumber = names_usable("Create") ? do_make(path, INODE_FILE) : 0;
+	pthread_rwlock_unlock(&fs_lock);
+	return inumber;
+}
+
+int fs_lookup( const char *path )
+{
+	char name[FS_NAME_MAX+1];
+	int inumber = 0;
+
+	pthread_rwlock_rdlock(&fs_lock);
+	if (names_usable("Lookup")) {
+		inumber = path_parent(path, name);
+		if (inumber && name[0])
+			inumber = dir_lookup(inumber, name);
+	}
+	pthread_rwlock_unlock(&fs_lock);
+	return inumber;
+}
+
+int fs_unlink( const char *path )
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	int result = names_usable("Unlink") ? do_unlink(path) : 0;
+	pthread_rwlock_unlock(&fs_lock);
+	return result;
+}
+
+// Call fn on every name in a directory, in no particular order. fn must not call back into the file system.
+int fs_listdir( const char *path, void (*fn)( const char *name, int inumber, void *arg ), void *arg )
+{
+	char name[FS_NAME_MAX+1];
+	int result = 0;
+
+	pthread_rwlock_rdlock(&fs_lock);
+	if (names_usable("List")) {
+		int inumber = path_parent(path, name);
+		if (inumber && name[0])
+			inumber = dir_lookup(inumber, name);
+		if (inumber)
+			result = do_listdir(inumber, fn, arg);
+	}
+	pthread_rwlock_unlock(&fs_lock);
+	return result;
 }
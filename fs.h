@@ -1,15 +1,57 @@
 #ifndef FS_H
 #define FS_H
 
+// Options for fs_format_with
+#define FS_EXTENTS 1	// map file data with extents instead of block pointers
+#define FS_DIRECTORIES 2	// keep a root directory, for naming files by path
+#define FS_INLINE 4	// larger inodes, keeping the data of small files in the record
+#define FS_COMPRESS 8	// let files keep their data compressed, chosen per file with fs_compress
+#define FS_DEDUP 16	// share data blocks with the same contents between files; not with FS_EXTENTS
+
+#define FS_NAME_MAX 55	// longest name in a directory
+
 void fs_debug();
 int  fs_format();
+int  fs_format_with( int flags );
 int  fs_mount();
+int  fs_unmount();
+// Put every change made so far on disk, rather than at the next commit
+int  fs_sync();
 
 int  fs_create();
 int  fs_delete( int inumber );
-int  fs_getsize();
+int  fs_create_many( int n, int *inumbers );
+int  fs_delete_many( const int *inumbers, int n );
+long fs_getsize( int inumber );
+int  fs_ninodes();
+
+int  fs_read( int inumber, char *data, int length, long offset );
+int  fs_write( int inumber, const char *data, int length, long offset );
+
+// Open files, for reading and writing from a position kept in the handle
+int  fs_open( int inumber );
+int  fs_close( int fd );
+long fs_seek( int fd, long offset );
+int  fs_fread( int fd, char *data, int length );
+int  fs_fwrite( int fd, const char *data, int length );
+
+// Store an empty file's data compressed from now on, on file systems formatted with FS_COMPRESS
+int  fs_compress( int inumber );
+
+// Copy-on-write copies, on file systems formatted with FS_DEDUP. A clone is a new,
+// unnamed file sharing the blocks of the original until either is written.
+int  fs_clone( int inumber );
+int  fs_snapshot( void (*fn)( int inumber, int clone, void *arg ), void *arg );
+
+// Streaming between a file, from its start, and a host file descriptor
+long fs_import( int inumber, int fd );
+long fs_export( int inumber, int fd );
 
-int  fs_read( int inumber, char *data, int length, int offset );
-int  fs_write( int inumber, const char *data, int length, int offset );
+// Names, on file systems formatted with FS_DIRECTORIES. Paths start at the root, as in /a/b.
+int  fs_mkdir( const char *path );
+int  fs_create_path( const char *path );
+int  fs_lookup( const char *path );
+int  fs_unlink( const char *path );
+int  fs_listdir( const char *path, void (*fn)( const char *name, int inumber, void *arg ), void *arg );
 
 #endif
@@ -0,0 +1,196 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "ioq.h"
+#include "disk.h"
+
+/*
+Asynchronous block I/O on top of disk.c. Submitted reads and writes go
+on a queue served by a pool of worker threads, and finished operations
+are handed back, with the tag given at submission, through a completion
+queue drained by ioq_reap. Operations complete in any order; callers
+must not submit two operations on the same block at once. With zero
+threads every operation runs inside the submit call, and ioq_reap just
+returns the completions in order.
+*/
+
+struct ioq_op {
+	int write;
+	int blocknum;
+	char *data;
+	void *tag;
+	struct ioq_op *next;
+};
+
+struct ioq_list {
+	struct ioq_op *head;
+	struct ioq_op *tail;
+};
+
+static pthread_t *workers = 0;
+static int nworkers = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_ready = PTHREAD_COND_INITIALIZER;
+static struct ioq_list submitted = {0,0};
+static struct ioq_list completed = {0,0};
+static int npending = 0;	// submitted and not yet reaped
+static int stopping = 0;
+
+static void list_push( struct ioq_list *l, struct ioq_op *op )
+{
+	op->next = 0;
+	if(l->tail) l->tail->next = op;
+	else l->head = op;
+	l->tail = op;
+}
+
+static struct ioq_op * list_pop( struct ioq_list *l )
+{
+	struct ioq_op *op = l->head;
+	if(op) {
+		l->head = op->next;
+		if(!l->head) l->tail = 0;
+	}
+	return op;
+}
+
+static void perform( struct ioq_op *op )
+{
+	if(op->write) disk_write(op->blocknum,op->data);
+	else disk_read(op->blocknum,op->data);
+}
+
+static void * worker( void *arg )
+{
+	pthread_mutex_lock(&lock);
+	while(1) {
+		struct ioq_op *op = list_pop(&submitted);
+		if(!op) {
+			if(stopping) break;
+			pthread_cond_wait(&work_ready,&lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&lock);
+		perform(op);
+		pthread_mutex_lock(&lock);
+
+		list_push(&completed,op);
+		pthread_cond_signal(&done_ready);
+	}
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+int ioq_init( int nthreads )
+{
+	ioq_close();
+
+	if(nthreads<=0) return 1;
+
+	workers = malloc(nthreads*sizeof(pthread_t));
+	if(!workers) return 0;
+
+	stopping = 0;
+	for(nworkers=0; nworkers<nthreads; nworkers++) {
+		if(pthread_create(&workers[nworkers],0,worker,0)) {
+			ioq_close();
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void submit( int write, int blocknum, char *data, void *tag )
+{
+	struct ioq_op *op = malloc(sizeof(*op));
+	if(!op) {
+		printf("ERROR: out of memory for I/O request\n");
+		abort();
+	}
+	op->write = write;
+	op->blocknum = blocknum;
+	op->data = data;
+	op->tag = tag;
+
+	if(!nworkers) {
+		perform(op);
+		pthread_mutex_lock(&lock);
+		list_push(&completed,op);
+		npending++;
+		pthread_cond_signal(&done_ready);
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	list_push(&submitted,op);
+	npending++;
+	pthread_cond_signal(&work_ready);
+	pthread_mutex_unlock(&lock);
+}
+
+void ioq_submit_read( int blocknum, char *data, void *tag )
+{
+	submit(0,blocknum,data,tag);
+}
+
+void ioq_submit_write( int blocknum, const char *data, void *tag )
+{
+	submit(1,blocknum,(char*)data,tag);
+}
+
+/*
+Wait for the next completion. Returns 0 when nothing is outstanding.
+Several threads may reap at once; one that loses the last completion to
+another is woken to find nothing pending and returns 0.
+*/
+int ioq_reap( void **tag )
+{
+	pthread_mutex_lock(&lock);
+	while(!completed.head && npending>0) {
+		pthread_cond_wait(&done_ready,&lock);
+	}
+	if(npending==0) {
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+	struct ioq_op *op = list_pop(&completed);
+	npending--;
+	if(npending==0) pthread_cond_broadcast(&done_ready);
+	pthread_mutex_unlock(&lock);
+
+	if(tag) *tag = op->tag;
+	free(op);
+	return 1;
+}
+
+int ioq_pending()
+{
+	pthread_mutex_lock(&lock);
+	int n = npending;
+	pthread_mutex_unlock(&lock);
+	return n;
+}
+
+void ioq_close()
+{
+	// Let the workers finish what was submitted, then stop them
+	while(ioq_reap(0)) {}
+
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_broadcast(&work_ready);
+	pthread_mutex_unlock(&lock);
+
+	for(int i=0; i<nworkers; i++) {
+		pthread_join(workers[i],0);
+	}
+	free(workers);
+	workers = 0;
+	nworkers = 0;
+	stopping = 0;
+}
@@ -0,0 +1,13 @@
+#ifndef IOQ_H
+#define IOQ_H
+
+#define IOQ_DEFAULT_THREADS 4
+
+int  ioq_init( int nthreads );
+void ioq_submit_read( int blocknum, char *data, void *tag );
+void ioq_submit_write( int blocknum, const char *data, void *tag );
+int  ioq_reap( void **tag );
+int  ioq_pending();
+void ioq_close();
+
+#endif
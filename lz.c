@@ -0,0 +1,172 @@
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/*
+Byte-oriented LZ77 compression in the LZ4 block format. Input is coded
+as sequences: a token byte holding a literal count and a match length
+in its two halves, longer counts continued in bytes of 255, the
+literals themselves, and a two-byte offset back to where the match
+starts. The last sequence has literals only. Matches are found through
+a hash table of the last position seen for each four bytes, so
+compression is one pass with no search, and decompression only copies.
+*/
+
+#define HASH_BITS      12
+#define MIN_MATCH      4
+#define LAST_LITERALS  5	// the input always ends in this many literals
+#define MATCH_LIMIT    12	// no match starts closer than this to the end
+#define MAX_OFFSET     65535
+#define SKIP_SHIFT     6	// misses after which the search takes longer strides
+
+static uint32_t read32( const unsigned char *p )
+{
+	uint32_t v;
+	memcpy(&v,p,sizeof(v));
+	return v;
+}
+
+static int hash4( uint32_t v )
+{
+	return (v*2654435761u) >> (32-HASH_BITS);
+}
+
+static unsigned char * put_length( unsigned char *op, int length )
+{
+	while(length>=255) {
+		*op++ = 255;
+		length -= 255;
+	}
+	*op++ = length;
+	return op;
+}
+
+// Append one sequence, or null if it does not fit; a zero match length ends the input
+static unsigned char * put_sequence( unsigned char *op, unsigned char *oend, const unsigned char *literals, int nliterals, int offset, int mlength )
+{
+	if(oend-op < 1 + nliterals + nliterals/255 + 1 + 2 + mlength/255 + 1) return 0;
+
+	unsigned char *token = op++;
+	*token = (nliterals<15 ? nliterals : 15) << 4;
+	if(nliterals>=15) op = put_length(op,nliterals-15);
+	memcpy(op,literals,nliterals);
+	op += nliterals;
+	if(mlength==0) return op;
+
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	mlength -= MIN_MATCH;
+	*token |= mlength<15 ? mlength : 15;
+	if(mlength>=15) op = put_length(op,mlength-15);
+	return op;
+}
+
+/*
+Compress n bytes into dst. Returns the compressed length, or 0 if it
+would take more than capacity bytes, which LZ_BOUND(n) always covers.
+*/
+int lz_compress( const char *src, int n, char *dst, int capacity )
+{
+	const unsigned char *base = (const unsigned char *)src;
+	const unsigned char *ip = base;
+	const unsigned char *anchor = base;
+	const unsigned char *iend = base + n;
+	unsigned char *op = (unsigned char *)dst;
+	unsigned char *oend = op + capacity;
+	int table[1<<HASH_BITS];
+
+	// Stale or zeroed entries only ever point back into the input, and are checked
+	memset(table,0,sizeof(table));
+
+	while(n>MATCH_LIMIT && ip<iend-MATCH_LIMIT) {
+		uint32_t seq = read32(ip);
+		int h = hash4(seq);
+		const unsigned char *ref = base + table[h];
+		table[h] = ip - base;
+
+		if(ref>=ip || ip-ref>MAX_OFFSET || read32(ref)!=seq) {
+			ip += 1 + ((ip-anchor) >> SKIP_SHIFT);
+			continue;
+		}
+
+		// Grow the match backwards over literals, then forwards
+		while(ip>anchor && ref>base && ip[-1]==ref[-1]) {
+			ip--;
+			ref--;
+		}
+		const unsigned char *mend = ip + MIN_MATCH;
+		const unsigned char *r = ref + MIN_MATCH;
+		while(mend<iend-LAST_LITERALS && *mend==*r) {
+			mend++;
+			r++;
+		}
+
+		op = put_sequence(op,oend,anchor,ip-anchor,ip-ref,mend-ip);
+		if(!op) return 0;
+
+		// Remember a position inside the match, for the next one to find
+		table[hash4(read32(mend-2))] = mend-2-base;
+		ip = anchor = mend;
+	}
+
+	op = put_sequence(op,oend,anchor,iend-anchor,0,0);
+	if(!op) return 0;
+	return op - (unsigned char *)dst;
+}
+
+static int get_length( const unsigned char **ip, const unsigned char *iend, long *length )
+{
+	int b;
+	do {
+		if(*ip>=iend) return 0;
+		b = *(*ip)++;
+		*length += b;
+	} while(b==255 && *length<=0x7fffffff);
+	return b!=255;
+}
+
+/*
+Decompress n bytes of lz_compress output into dst. Returns the length
+decompressed, or -1 if the input is damaged or would overrun capacity.
+*/
+int lz_decompress( const char *src, int n, char *dst, int capacity )
+{
+	const unsigned char *ip = (const unsigned char *)src;
+	const unsigned char *iend = ip + n;
+	unsigned char *op = (unsigned char *)dst;
+	unsigned char *oend = op + capacity;
+
+	while(ip<iend) {
+		int token = *ip++;
+
+		long nliterals = token >> 4;
+		if(nliterals==15 && !get_length(&ip,iend,&nliterals)) return -1;
+		if(nliterals>iend-ip || nliterals>oend-op) return -1;
+		memcpy(op,ip,nliterals);
+		op += nliterals;
+		ip += nliterals;
+		if(ip==iend) break;
+
+		if(iend-ip<2) return -1;
+		int offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if(offset==0 || offset>op-(unsigned char *)dst) return -1;
+
+		long mlength = token & 15;
+		if(mlength==15 && !get_length(&ip,iend,&mlength)) return -1;
+		mlength += MIN_MATCH;
+		if(mlength>oend-op) return -1;
+
+		// Matches may overlap what they produce, repeating a short pattern
+		const unsigned char *ref = op - offset;
+		if(offset>=mlength) {
+			memcpy(op,ref,mlength);
+		} else {
+			for(long i=0; i<mlength; i++) op[i] = ref[i];
+		}
+		op += mlength;
+	}
+	return op - (unsigned char *)dst;
+}
@@ -0,0 +1,10 @@
+#ifndef LZ_H
+#define LZ_H
+
+// Most bytes lz_compress may need for n bytes of input
+#define LZ_BOUND(n) ((n) + (n)/255 + 16)
+
+int  lz_compress( const char *src, int n, char *dst, int capacity );
+int  lz_decompress( const char *src, int n, char *dst, int capacity );
+
+#endif
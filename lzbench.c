@@ -0,0 +1,116 @@
+#include "lz.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+Measure what compressing a host file would save a compressed simplefs
+file, against the time it costs. The file is cut into clusters as fs.c
+cuts compressed files, each compressed the way fs.c stores it, and the
+blocks it takes are counted both ways; the compression and
+decompression of every cluster are then timed over several rounds.
+*/
+
+#define CLUSTER_BLOCKS 8	// as in fs.c
+#define CLUSTER_SIZE   (CLUSTER_BLOCKS*DISK_BLOCK_SIZE)
+#define HEADER_SIZE    12	// struct fs_cluster
+#define MIN_SECONDS    0.5	// rounds go on until at least this long
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static int blocks_for( long bytes )
+{
+	return (bytes + DISK_BLOCK_SIZE - 1)/DISK_BLOCK_SIZE;
+}
+
+int main( int argc, char *argv[] )
+{
+	if(argc!=2) {
+		printf("use: %s <file>\n",argv[0]);
+		return 1;
+	}
+
+	FILE *file = fopen(argv[1],"rb");
+	if(!file) {
+		printf("couldn't open %s\n",argv[1]);
+		return 1;
+	}
+	fseek(file,0,SEEK_END);
+	long size = ftell(file);
+	fseek(file,0,SEEK_SET);
+	char *data = malloc(size+1);
+	if(fread(data,1,size,file)!=(size_t)size) {
+		printf("couldn't read %s\n",argv[1]);
+		return 1;
+	}
+	fclose(file);
+
+	int nclusters = (size + CLUSTER_SIZE - 1)/CLUSTER_SIZE;
+	int room = (CLUSTER_BLOCKS-1)*DISK_BLOCK_SIZE - HEADER_SIZE;
+	char *packed = malloc((long)nclusters*room);
+	int *lengths = malloc(nclusters*sizeof(int));
+	char *out = malloc(CLUSTER_SIZE);
+	long plain = 0, stored = 0, compressed = 0;
+
+	// Blocks taken as fs.c stores each cluster
+	for(int i=0; i<nclusters; i++) {
+		int n = size - (long)i*CLUSTER_SIZE < CLUSTER_SIZE ? size - (long)i*CLUSTER_SIZE : CLUSTER_SIZE;
+		lengths[i] = lz_compress(data + (long)i*CLUSTER_SIZE,n,packed + (long)i*room,room);
+		plain += blocks_for(n);
+		if(lengths[i]>=n) lengths[i] = 0;
+		compressed += lengths[i]>0 ? lengths[i] : n;
+		if(lengths[i]>0) {
+			stored += blocks_for(HEADER_SIZE + lengths[i]);
+		} else if(n<=room) {
+			stored += blocks_for(HEADER_SIZE + n);
+		} else {
+			stored += CLUSTER_BLOCKS;
+		}
+	}
+
+	int rounds = 0;
+	double start = now();
+	do {
+		for(int i=0; i<nclusters; i++) {
+			int n = size - (long)i*CLUSTER_SIZE < CLUSTER_SIZE ? size - (long)i*CLUSTER_SIZE : CLUSTER_SIZE;
+			lz_compress(data + (long)i*CLUSTER_SIZE,n,out,room);
+		}
+		rounds++;
+	} while(now()-start<MIN_SECONDS);
+	double ctime = (now()-start)/rounds;
+
+	rounds = 0;
+	start = now();
+	do {
+		for(int i=0; i<nclusters; i++) {
+			int n = size - (long)i*CLUSTER_SIZE < CLUSTER_SIZE ? size - (long)i*CLUSTER_SIZE : CLUSTER_SIZE;
+			if(lengths[i]>0 && lz_decompress(packed + (long)i*room,lengths[i],out,CLUSTER_SIZE)!=n) {
+				printf("cluster %d does not decompress to what it was!\n",i);
+				return 1;
+			}
+		}
+		rounds++;
+	} while(now()-start<MIN_SECONDS);
+	double dtime = (now()-start)/rounds;
+
+	long saved = plain - stored;
+	printf("%s: %ld bytes, %d clusters of %d blocks\n",argv[1],size,nclusters,CLUSTER_BLOCKS);
+	printf("    compressed to %ld bytes, %.1f%%\n",compressed,size ? 100.0*compressed/size : 0);
+	printf("    blocks: %ld as they are, %ld compressed, %ld saved (%.1f%%)\n",plain,stored,saved,plain ? 100.0*saved/plain : 0);
+	printf("    compress:   %8.1f MB/s, %6.2f us per block saved\n",size/ctime/1e6,saved ? ctime*1e6/saved : 0);
+	printf("    decompress: %8.1f MB/s, %6.2f us per block saved\n",size/dtime/1e6,saved ? dtime*1e6/saved : 0);
+
+	free(data);
+	free(packed);
+	free(lengths);
+	free(out);
+	return 0;
+}
@@ -1,14 +1,24 @@
 
 #include "fs.h"
 #include "disk.h"
+#include "cache.h"
+#include "ioq.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 static int do_copyin( const char *filename, int inumber );
 static int do_copyout( int inumber, const char *filename );
+static int do_export( int inumber, int fd, const char *name );
+static int format_flags( char *options );
+static int inode_arg( const char *arg );
+static void print_name( const char *name, int inumber, void *arg );
+static void print_inumbers( const int *inumbers, int n );
+static void print_clone( int inumber, int clone, void *arg );
 
 int main( int argc, char *argv[] )
 {
@@ -16,19 +26,55 @@ int main( int argc, char *argv[] )
 	char cmd[1024];
 	char arg1[1024];
 	char arg2[1024];
-	int inumber, result, args;
+	int inumber, args;
+	long result;
+	int cacheblocks = CACHE_DEFAULT_BLOCKS;
+	int iothreads = IOQ_DEFAULT_THREADS;
+	int diskflags = 0;
+	int opt;
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	while((opt=getopt(argc,argv,"mt:"))!=-1) {
+		if(opt=='m') {
+			diskflags |= DISK_MMAP;
+		} else if(opt=='t') {
+			iothreads = atoi(optarg);
+		} else {
+			argc = 0;
+		}
+	}
+
+	// Remaining arguments: <diskfile> <nblocks> [cacheblocks]
+	char **pos = argv + optind;
+	int npos = argc - optind;
+
+	if(npos!=2 && npos!=3) {
+		printf("use: %s [-m] [-t threads] <diskfile> <nblocks> [cacheblocks]\n",argv[0]);
+		printf("    -m  memory-map the disk image\n");
+		printf("    -t  number of asynchronous I/O threads, 0 for synchronous I/O\n");
 		return 1;
 	}
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
-		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
+	if(npos==3) cacheblocks = atoi(pos[2]);
+
+	if(!disk_open(pos[0],atoi(pos[1]),diskflags)) {
+		printf("couldn't initialize %s: %s\n",pos[0],strerror(errno));
 		return 1;
 	}
 
-	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
+	if(!cache_init(cacheblocks)) {
+		printf("couldn't allocate a cache of %d blocks\n",cacheblocks);
+		disk_close();
+		return 1;
+	}
+
+	if(!ioq_init(iothreads)) {
+		printf("couldn't start %d I/O threads\n",iothreads);
+		cache_close();
+		disk_close();
+		return 1;
+	}
+
+	printf("opened emulated disk image %s with %d blocks\n",pos[0],disk_size());
 
 	while(1) {
 		printf(" simplefs> ");
@@ -43,14 +89,15 @@ int main( int argc, char *argv[] )
 		if(args==0) continue;
 
 		if(!strcmp(cmd,"format")) {
-			if(args==1) {
-				if(fs_format()) {
+			int flags = format_flags(line+strlen(cmd));
+			if(flags>=0) {
+				if(fs_format_with(flags)) {
 					printf("disk formatted.\n");
 				} else {
 					printf("format failed!\n");
 				}
 			} else {
-				printf("use: format\n");
+				printf("use: format [extents] [dirs] [inline] [compress] [dedup]\n");
 			}
 		} else if(!strcmp(cmd,"mount")) {
 			if(args==1) {
@@ -62,6 +109,26 @@ int main( int argc, char *argv[] )
 			} else {
 				printf("use: mount\n");
 			}
+		} else if(!strcmp(cmd,"unmount")) {
+			if(args==1) {
+				if(fs_unmount()) {
+					printf("disk unmounted.\n");
+				} else {
+					printf("unmount failed!\n");
+				}
+			} else {
+				printf("use: unmount\n");
+			}
+		} else if(!strcmp(cmd,"sync")) {
+			if(args==1) {
+				if(fs_sync()) {
+					printf("disk synced.\n");
+				} else {
+					printf("sync failed!\n");
+				}
+			} else {
+				printf("use: sync\n");
+			}
 		} else if(!strcmp(cmd,"debug")) {
 			if(args==1) {
 				fs_debug();
@@ -73,7 +140,7 @@ int main( int argc, char *argv[] )
 				inumber = atoi(arg1);
 				result = fs_getsize(inumber);
 				if(result>=0) {
-					printf("inode %d has size %d\n",inumber,result);
+					printf("inode %d has size %ld\n",inumber,result);
 				} else {
 					printf("getsize failed!\n");
 				}
@@ -89,11 +156,38 @@ int main( int argc, char *argv[] )
 				} else {
 					printf("create failed!\n");
 				}
+			} else if(args==2 && atoi(arg1)>0) {
+				// No more can be created than there are inodes
+				int n = atoi(arg1);
+				if(n>fs_ninodes()) n = fs_ninodes();
+				int *inumbers = malloc((n>0 ? n : 1)*sizeof(int));
+				if(inumbers) n = fs_create_many(n,inumbers);
+				if(inumbers && n>0) {
+					printf("created %d inodes: ",n);
+					print_inumbers(inumbers,n);
+				} else {
+					printf("create failed!\n");
+				}
+				free(inumbers);
 			} else {
-				printf("use: create\n");
+				printf("use: create [count]\n");
 			}
 		} else if(!strcmp(cmd,"delete")) {
-			if(args==2) {
+			int first, last;
+			if(args==2 && sscanf(arg1,"%d-%d",&first,&last)==2 && first<=last) {
+				// Only inumbers the file system has can be deleted
+				if(first<1) first = 1;
+				if(last>fs_ninodes()-1) last = fs_ninodes()-1;
+				int n = first<=last ? last-first+1 : 0;
+				int *inumbers = malloc((n>0 ? n : 1)*sizeof(int));
+				if(inumbers) {
+					for(int i=0; i<n; i++) inumbers[i] = first+i;
+					printf("%d inodes deleted.\n",fs_delete_many(inumbers,n));
+				} else {
+					printf("delete failed!\n");
+				}
+				free(inumbers);
+			} else if(args==2) {
 				inumber = atoi(arg1);
 				if(fs_delete(inumber)) {
 					printf("inode %d deleted.\n",inumber);
@@ -101,52 +195,145 @@ int main( int argc, char *argv[] )
 					printf("delete failed!\n");	
 				}
 			} else {
-				printf("use: delete <inumber>\n");
+				printf("use: delete <inumber>|<first>-<last>\n");
+			}
+		} else if(!strcmp(cmd,"mkdir")) {
+			if(args==2) {
+				inumber = fs_mkdir(arg1);
+				if(inumber>0) {
+					printf("created directory %s as inode %d\n",arg1,inumber);
+				} else {
+					printf("mkdir failed!\n");
+				}
+			} else {
+				printf("use: mkdir <path>\n");
+			}
+		} else if(!strcmp(cmd,"touch")) {
+			if(args==2) {
+				inumber = fs_create_path(arg1);
+				if(inumber>0) {
+					printf("created %s as inode %d\n",arg1,inumber);
+				} else {
+					printf("touch failed!\n");
+				}
+			} else {
+				printf("use: touch <path>\n");
+			}
+		} else if(!strcmp(cmd,"ls")) {
+			if(args<=2) {
+				if(!fs_listdir(args==2 ? arg1 : "/",print_name,0)) {
+					printf("ls failed!\n");
+				}
+			} else {
+				printf("use: ls [path]\n");
+			}
+		} else if(!strcmp(cmd,"rm")) {
+			if(args==2) {
+				if(fs_unlink(arg1)) {
+					printf("removed %s\n",arg1);
+				} else {
+					printf("rm failed!\n");
+				}
+			} else {
+				printf("use: rm <path>\n");
+			}
+		} else if(!strcmp(cmd,"lookup")) {
+			if(args==2) {
+				inumber = fs_lookup(arg1);
+				if(inumber>0) {
+					printf("%s is inode %d\n",arg1,inumber);
+				} else {
+					printf("lookup failed!\n");
+				}
+			} else {
+				printf("use: lookup <path>\n");
+			}
+		} else if(!strcmp(cmd,"compress")) {
+			if(args==2) {
+				inumber = inode_arg(arg1);
+				if(fs_compress(inumber)) {
+					printf("inode %d will be compressed\n",inumber);
+				} else {
+					printf("compress failed!\n");
+				}
+			} else {
+				printf("use: compress <inumber>|<path>\n");
+			}
+		} else if(!strcmp(cmd,"clone")) {
+			if(args==2) {
+				inumber = inode_arg(arg1);
+				result = fs_clone(inumber);
+				if(result>0) {
+					printf("inode %d cloned to inode %ld\n",inumber,result);
+				} else {
+					printf("clone failed!\n");
+				}
+			} else {
+				printf("use: clone <inumber>|<path>\n");
+			}
+		} else if(!strcmp(cmd,"snapshot")) {
+			if(args==1) {
+				result = fs_snapshot(print_clone,0);
+				printf("%ld files in the snapshot\n",result);
+			} else {
+				printf("use: snapshot\n");
 			}
 		} else if(!strcmp(cmd,"cat")) {
 			if(args==2) {
-				inumber = atoi(arg1);
-				if(!do_copyout(inumber,"/dev/stdout")) {
+				inumber = inode_arg(arg1);
+				if(!do_export(inumber,STDOUT_FILENO,"stdout")) {
 					printf("cat failed!\n");
 				}
 			} else {
-				printf("use: cat <inumber>\n");
+				printf("use: cat <inumber>|<path>\n");
 			}
 
 		} else if(!strcmp(cmd,"copyin")) {
 			if(args==3) {
-				inumber = atoi(arg2);
+				// A path names the file to copy into, made if missing
+				inumber = inode_arg(arg2);
+				if(!inumber && arg2[0]=='/') inumber = fs_create_path(arg2);
 				if(do_copyin(arg1,inumber)) {
 					printf("copied file %s to inode %d\n",arg1,inumber);
 				} else {
 					printf("copy failed!\n");
 				}
 			} else {
-				printf("use: copyin <filename> <inumber>\n");
+				printf("use: copyin <filename> <inumber>|<path>\n");
 			}
 
 		} else if(!strcmp(cmd,"copyout")) {
 			if(args==3) {
-				inumber = atoi(arg1);
+				inumber = inode_arg(arg1);
 				if(do_copyout(inumber,arg2)) {
 					printf("copied inode %d to file %s\n",inumber,arg2);
 				} else {
 					printf("copy failed!\n");
 				}
 			} else {
-				printf("use: copyout <inumber> <filename>\n");
+				printf("use: copyout <inumber>|<path> <filename>\n");
 			}
 
 		} else if(!strcmp(cmd,"help")) {
 			printf("Commands are:\n");
-			printf("    format\n");
+			printf("    format  [extents] [dirs] [inline] [compress] [dedup]\n");
 			printf("    mount\n");
+			printf("    unmount\n");
+			printf("    sync\n");
 			printf("    debug\n");
-			printf("    create\n");
-			printf("    delete  <inode>\n");
-			printf("    cat     <inode>\n");
-			printf("    copyin  <file> <inode>\n");
-			printf("    copyout <inode> <file>\n");
+			printf("    create  [count]\n");
+			printf("    delete  <inode>|<first>-<last>\n");
+			printf("    mkdir   <path>\n");
+			printf("    touch   <path>\n");
+			printf("    ls      [path]\n");
+			printf("    rm      <path>\n");
+			printf("    lookup  <path>\n");
+			printf("    compress <inode>|<path>\n");
+			printf("    clone   <inode>|<path>\n");
+			printf("    snapshot\n");
+			printf("    cat     <inode>|<path>\n");
+			printf("    copyin  <file> <inode>|<path>\n");
+			printf("    copyout <inode>|<path> <file>\n");
 			printf("    help\n");
 			printf("    quit\n");
 			printf("    exit\n");
@@ -162,6 +349,9 @@ int main( int argc, char *argv[] )
 	}
 
 	printf("closing emulated disk.\n");
+	fs_unmount();
+	ioq_close();
+	cache_close();
 	disk_close();
 
 	return 0;
@@ -169,61 +359,107 @@ int main( int argc, char *argv[] )
 
 static int do_copyin( const char *filename, int inumber )
 {
-	FILE *file;
-	int offset=0, result, actual;
-	char buffer[16384];
+	int fd;
+	long result;
 
-	file = fopen(filename,"r");
-	if(!file) {
+	fd = open(filename,O_RDONLY);
+	if(fd<0) {
 		printf("couldn't open %s: %s\n",filename,strerror(errno));
 		return 0;
 	}
 
-	while(1) {
-		result = fread(buffer,1,sizeof(buffer),file);
-		if(result<=0) break;
-		if(result>0) {
-			actual = fs_write(inumber,buffer,result,offset);
-			if(actual<0) {
-				printf("ERROR: fs_write return invalid result %d\n",actual);
-				break;
-			}
-			offset += actual;
-			if(actual!=result) {
-				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
-				break;
-			}
-		}
+	result = fs_import(inumber,fd);
+	if(result<0) {
+		printf("couldn't read %s: %s\n",filename,strerror(errno));
+	} else {
+		printf("%ld bytes copied\n",result);
 	}
 
-	printf("%d bytes copied\n",offset);
-
-	fclose(file);
-	return 1;
+	close(fd);
+	return result>=0;
 }
 
 static int do_copyout( int inumber, const char *filename )
 {
-	FILE *file;
-	int offset=0, result;
-	char buffer[16384];
+	int fd, result;
 
-	file = fopen(filename,"w");
-	if(!file) {
+	fd = open(filename,O_WRONLY|O_CREAT|O_TRUNC,0666);
+	if(fd<0) {
 		printf("couldn't open %s: %s\n",filename,strerror(errno));
 		return 0;
 	}
 
-	while(1) {
-		result = fs_read(inumber,buffer,sizeof(buffer),offset);
-		if(result<=0) break;
-		fwrite(buffer,1,result,file);
-		offset += result;
+	result = do_export(inumber,fd,filename);
+	close(fd);
+	return result;
+}
+
+static int do_export( int inumber, int fd, const char *name )
+{
+	long result;
+
+	// Anything the shell has printed goes out ahead of the file
+	fflush(stdout);
+	result = fs_export(inumber,fd);
+	if(result<0) {
+		printf("couldn't write %s: %s\n",name,strerror(errno));
+	} else {
+		printf("%ld bytes copied\n",result);
+	}
+	return result>=0;
+}
+
+
+// Options given after format, as FS_ flags, or -1 for an unknown one
+static int format_flags( char *options )
+{
+	int flags = 0;
+
+	for(char *opt=strtok(options," \t"); opt; opt=strtok(0," \t")) {
+		if(!strcmp(opt,"extents")) {
+			flags |= FS_EXTENTS;
+		} else if(!strcmp(opt,"dirs")) {
+			flags |= FS_DIRECTORIES;
+		} else if(!strcmp(opt,"inline")) {
+			flags |= FS_INLINE;
+		} else if(!strcmp(opt,"compress")) {
+			flags |= FS_COMPRESS;
+		} else if(!strcmp(opt,"dedup")) {
+			flags |= FS_DEDUP;
+		} else {
+			printf("unknown format option: %s\n",opt);
+			return -1;
+		}
+	}
+	return flags;
+}
+
+// Print a list of inode numbers, runs of consecutive ones as first-last
+static void print_inumbers( const int *inumbers, int n )
+{
+	for(int i=0; i<n; ) {
+		int j = i;
+		while(j+1<n && inumbers[j+1]==inumbers[j]+1) j++;
+		if(j>i) printf("%d-%d",inumbers[i],inumbers[j]);
+		else printf("%d",inumbers[i]);
+		printf(j==n-1 ? "\n" : " ");
+		i = j+1;
 	}
+}
 
-	printf("%d bytes copied\n",offset);
+// An inode given by number, or by path when it starts with a slash
+static int inode_arg( const char *arg )
+{
+	if(arg[0]=='/') return fs_lookup(arg);
+	return atoi(arg);
+}
 
-	fclose(file);
-	return 1;
+static void print_name( const char *name, int inumber, void *arg )
+{
+	printf("%8d %s\n",inumber,name);
 }
 
+static void print_clone( int inumber, int clone, void *arg )
+{
+	printf("inode %d cloned to inode %d\n",inumber,clone);
+}
@@ -0,0 +1,45 @@
+#!/bin/sh
+# A clone shares its original's blocks until one of them is written,
+# after which each reads back its own data. A file deleted while a clone
+# still shares its blocks frees none of them, and deleting every copy
+# gives every block back.
+
+cd "$(dirname "$0")/.." || exit 1
+image=$(mktemp) || exit 1
+out=$(mktemp) || exit 1
+trap 'rm -f "$image" "$out" "$out".*' EXIT
+
+# A field of every debug listing in the output, one line each
+field() {
+	sed -n "s/^    \([0-9]*\) $1.*/\1/p"
+}
+
+fail() {
+	echo "clone: $1"
+	exit 1
+}
+
+# Same length as apple.txt, different in most blocks
+tr 'a-z' 'A-Z' < apple.txt > "$out.upper"
+
+printf 'format dedup\nmount\ndebug\ncreate\ncopyin apple.txt 1\ndebug\nclone 1\nclone 1\ndebug
+copyin %s.upper 2\ndebug\ncopyout 1 %s.1\ncopyout 2 %s.2\nunmount\nmount
+copyout 1 %s.3\ncopyout 2 %s.4\ndelete 1\ndebug\ncopyout 3 %s.5\ndelete 2\ndelete 3\ndebug\n' \
+	"$out" "$out" "$out" "$out" "$out" "$out" | ./simplefs "$image" 200 > "$out"
+
+grep -q 'inode 1 cloned to inode 2' "$out" || fail "clone failed"
+grep -q 'inode 1 cloned to inode 3' "$out" || fail "second clone failed"
+cmp -s apple.txt "$out.1" || fail "original changed by writing the clone"
+cmp -s "$out.upper" "$out.2" || fail "clone differs"
+cmp -s apple.txt "$out.3" || fail "original differs after remount"
+cmp -s "$out.upper" "$out.4" || fail "clone differs after remount"
+cmp -s apple.txt "$out.5" || fail "second clone differs after deleting the original"
+
+# Free blocks when formatted, with the file, with two clones, after writing
+# one of them, after deleting the original, and with none left
+free=$(field 'free blocks' < "$out" | tr '\n' ' ')
+set -- $free
+[ "$2" = "$3" ] || fail "cloning copied blocks: $free"
+[ "$4" = "$5" ] || fail "deleting the original freed blocks still shared: $free"
+[ "$1" = "$6" ] || fail "blocks leaked: $free"
+echo "clone: ok"
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Creating a file on a version 0 image (32-byte inodes) must leave the
+# inodes already on it untouched.
+
+cd "$(dirname "$0")/.." || exit 1
+image=$(mktemp) || exit 1
+trap 'rm -f "$image"' EXIT
+cp image.20 "$image"
+
+# The debug listing of every inode but the one given
+inodes() {
+	awk -v skip="inode $1:" '/^inode /{show = $0 != skip}
+		!/^inode / && !/^    /{show = 0} show'
+}
+
+before=$(printf 'mount\ndebug\n' | ./simplefs "$image" 20 | inodes 0)
+after=$(printf 'mount\ncreate\ndebug\n' | ./simplefs "$image" 20)
+created=$(printf '%s\n' "$after" | sed -n 's/.*created inode \([0-9]*\).*/\1/p')
+if [ -z "$created" ]; then
+	echo "create_v0: create failed"
+	exit 1
+fi
+after=$(printf '%s\n' "$after" | inodes "$created")
+
+if [ "$before" != "$after" ]; then
+	echo "create_v0: existing inodes changed"
+	printf '%s\n' "$before" > "$image"
+	printf '%s\n' "$after" | diff "$image" -
+	exit 1
+fi
+echo "create_v0: ok"
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Two files with the same contents share their blocks on a file system
+# formatted with dedup, read back intact, and give every block back once
+# both are deleted.
+
+cd "$(dirname "$0")/.." || exit 1
+image=$(mktemp) || exit 1
+out=$(mktemp) || exit 1
+trap 'rm -f "$image" "$out" "$out".*' EXIT
+
+# A field of every debug listing in the output, one line each
+field() {
+	sed -n "s/^    \([0-9]*\) $1.*/\1/p"
+}
+
+fail() {
+	echo "dedup: $1"
+	exit 1
+}
+
+printf 'format dedup\nmount\ndebug\ncreate\ncopyin apple.txt 1\ncreate\ncopyin apple.txt 2
+debug\nunmount\nmount\ncopyout 1 %s.1\ncopyout 2 %s.2\ndelete 1\ndebug\ncopyout 2 %s.3
+delete 2\ndebug\n' "$out" "$out" "$out" | ./simplefs "$image" 200 > "$out"
+
+shared=$(field 'shared blocks' < "$out" | sed -n 2p)
+[ "${shared:-0}" -gt 0 ] || fail "no blocks shared"
+cmp -s apple.txt "$out.1" || fail "inode 1 differs"
+cmp -s apple.txt "$out.2" || fail "inode 2 differs"
+cmp -s apple.txt "$out.3" || fail "inode 2 differs after deleting inode 1"
+
+# Free blocks when formatted, with both files, with one, and with none
+free=$(field 'free blocks' < "$out" | tr '\n' ' ')
+set -- $free
+# Deleting one file frees only what it did not share, such as its indirect block
+[ $(($3 - $2)) -lt "$shared" ] || fail "shared blocks freed with one user left: $free"
+[ "$1" = "$4" ] || fail "blocks leaked: $free"
+echo "dedup: ok"
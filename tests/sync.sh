@@ -0,0 +1,23 @@
+#!/bin/sh
+# What was synced survives a crash: the shell is killed after a sync,
+# without unmounting, and the file reads back intact on the next mount.
+
+cd "$(dirname "$0")/.." || exit 1
+image=$(mktemp) || exit 1
+out=$(mktemp) || exit 1
+trap 'rm -f "$image" "$out" "$out".*' EXIT
+
+fail() {
+	echo "sync: $1"
+	exit 1
+}
+
+# Killed while waiting for more input, before the flusher's first round
+({ printf 'format\nmount\ncreate\ncopyin apple.txt 1\nsync\n'; sleep 2; } |
+	timeout -s KILL 1 ./simplefs "$image" 200 > /dev/null) 2> /dev/null
+
+printf 'debug\nmount\ncopyout 1 %s.1\n' "$out" | ./simplefs "$image" 200 > "$out"
+
+grep -q 'not cleanly unmounted' "$out" || fail "the shell was not killed before unmounting"
+cmp -s apple.txt "$out.1" || fail "synced file lost in the crash"
+echo "sync: ok"